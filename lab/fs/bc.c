@@ -2,6 +2,10 @@
 #include "fs.h"
 
 #define debug 0
+
+// Blocks brought in by one block cache miss, including the faulting one.
+#define BC_READAHEAD	8
+
 // Return the virtual address of this disk block.
 void*
 diskaddr(uint32_t blockno)
@@ -34,6 +38,7 @@ bc_pgfault(struct UTrapframe *utf)
 	void *addr = (void *) utf->utf_fault_va;
 	//cprintf("bc_pgfault: addr %08x, err %08x\n", addr, utf->utf_err);
 	uint32_t blockno = ((uint32_t)addr - DISKMAP) / BLKSIZE;
+	uint32_t i, n;
 	int r;
 
 	// Check that the fault was within the block cache region
@@ -51,19 +56,33 @@ bc_pgfault(struct UTrapframe *utf)
 	// the page dirty).
 	//
 	// LAB 5: Your code here
+	// Also read ahead up to BC_READAHEAD-1 following blocks that
+	// are not cached yet: their pages are allocated in one batch,
+	// filled with one ide_read, and marked clean in a second batch.
 	//cprintf("bc_pgfault: addr %08x, err %08x\n", addr, utf->utf_err);
-	if ((r = sys_page_alloc(0, ROUNDDOWN(addr, PGSIZE), 
-	        PTE_P | PTE_U | PTE_W)) < 0)
-		panic("page alloc failed: addr %08x, err %e", ROUNDDOWN(addr, PGSIZE), r);
-
-	if ((r = ide_read(blockno * BLKSECTS, diskaddr(blockno), BLKSECTS)) < 0)
+	addr = ROUNDDOWN(addr, PGSIZE);
+	n = 1;
+	if (super)
+		while (n < BC_READAHEAD && blockno + n < super->s_nblocks
+		       && !va_is_mapped(diskaddr(blockno + n)))
+			n++;
+
+	for (i = 0; i < n; i++)
+		batch_add(SYS_page_alloc, 0, (uint32_t) addr + i * BLKSIZE,
+			  PTE_P | PTE_U | PTE_W, 0, 0);
+	if ((r = batch_flush()) < 0)
+		panic("page alloc failed: addr %08x, err %e", addr, r);
+
+	if ((r = ide_read(blockno * BLKSECTS, addr, n * BLKSECTS)) < 0)
 		panic("ide read failed: secno %08x, dst %08x, nsecs %08x, err %e",
-			blockno * BLKSECTS, diskaddr(blockno), BLKSECTS, r);
+			blockno * BLKSECTS, addr, n * BLKSECTS, r);
 	
-	if ((r = sys_page_map(0, ROUNDDOWN(addr, PGSIZE), 0, ROUNDDOWN(addr, PGSIZE),
-		    PTE_P | PTE_U | PTE_W)) < 0)
+	for (i = 0; i < n; i++)
+		batch_add(SYS_page_map, 0, (uint32_t) addr + i * BLKSIZE,
+			  0, (uint32_t) addr + i * BLKSIZE, PTE_P | PTE_U | PTE_W);
+	if ((r = batch_flush()) < 0)
 		panic("page map for marking the page: addr %08x, err %e", 
-				ROUNDDOWN(addr, PGSIZE), r); 
+				addr, r); 
 
 	// Check that the block we read was allocated. (exercise for
 	// the reader: why do we do this *after* reading the block
@@ -46,7 +46,17 @@ struct OpenFile opentab[MAXOPEN] = {
 };
 
 // Virtual address at which to receive page mappings containing client requests.
-union Fsipc *fsreq = (union Fsipc *)0x0ffff000;
+// Requests arrive in a window of FSREQ_NPAGES pages, just below the
+// disk map: the request page, then the data pages of a big read or
+// write (see fsipc in lib/file.c).  fsdata_len says how many bytes of
+// data pages came with the current request.
+#define FSREQ_NPAGES	(1 + IPCDATA_NPAGES)
+union Fsipc *fsreq = (union Fsipc *)(DISKMAP - FSREQ_NPAGES * PGSIZE);
+char *fsdata = (char *)(DISKMAP - IPCDATA_NPAGES * PGSIZE);
+size_t fsdata_len;
+
+// Where the arguments of a register request (see FSREQ_REGS) go.
+static union Fsipc fsreq_regs;
 
 void
 serve_init(void)
@@ -221,6 +231,15 @@ serve_read(envid_t envid, union Fsipc *ipc)
 	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
 		return r;
 	
+	if (fsdata_len) {
+		// Read straight into the client's data pages.
+		if ((r = file_read(o->o_file, fsdata, MIN(req->req_n, fsdata_len),
+				   o->o_fd->fd_offset)) < 0)
+			return r;
+		o->o_fd->fd_offset += r;
+		return r;
+	}
+	
 	int want_read_bytes = req->req_n > PGSIZE ? PGSIZE : req->req_n;
 	if ((r = file_read(o->o_file, fsreq, 
 									want_read_bytes, o->o_fd->fd_offset)) < 0)
@@ -250,8 +269,9 @@ serve_write(envid_t envid, struct Fsreq_write *req)
 	}
 	
 	if ((r = file_write(o->o_file, 
-						req->req_buf,
-						req->req_n, 
+						fsdata_len ? fsdata : req->req_buf,
+						fsdata_len ? MIN(req->req_n, fsdata_len)
+							   : req->req_n, 
 						o->o_fd->fd_offset)) < 0) {
 		if (debug)
 			cprintf("serve_write: file_write fail\n");
@@ -349,18 +369,38 @@ void
 serve(void)
 {
 	uint32_t req, whom;
-	int perm, r;
-	void *pg;
+	int perm, r, reply = 0;
+	void *pg = NULL;
+	union Fsipc *args;
+	struct IpcPages reply_pg;
 
 	while (1) {
-		perm = 0;
-		req = ipc_recv((int32_t *) &whom, fsreq, &perm);
+		// Reply to the last request and wait for the next one in a
+		// single system call, so the kernel can switch straight to
+		// the client we answer.
+		if (reply) {
+			if (args == fsreq)
+				sys_page_unmap(0, fsreq);
+			req = ipc_callv(whom, r, &reply_pg, (envid_t *) &whom,
+					fsreq, FSREQ_NPAGES, &perm);
+		} else
+			req = ipc_recvv((envid_t *) &whom, fsreq, FSREQ_NPAGES,
+					&perm);
+		reply = 0;
+		fsdata_len = thisenv->env_ipc_npages > 1 ?
+			(thisenv->env_ipc_npages - 1) * PGSIZE : 0;
 		if (debug)
 			cprintf("fs req %d from %08x [page %08x: %s]\n",
 				req, whom, vpt[PGNUM(fsreq)], fsreq);
 
-		// All requests must contain an argument page
-		if (!(perm & PTE_P)) {
+		// All requests but register requests must contain an
+		// argument page
+		args = fsreq;
+		if (!(perm & PTE_P) && FSREQ_REGS(req)) {
+			memmove(&fsreq_regs, (void *) thisenv->env_ipc_regs,
+				sizeof(thisenv->env_ipc_regs));
+			args = &fsreq_regs;
+		} else if (!(perm & PTE_P)) {
 			cprintf("Invalid request from %08x: no argument page\n",
 				whom);
 			continue; // just leave it hanging...
@@ -370,13 +410,15 @@ serve(void)
 		if (req == FSREQ_OPEN) {
 			r = serve_open(whom, (struct Fsreq_open*)fsreq, &pg, &perm);
 		} else if (req < NHANDLERS && handlers[req]) {
-			r = handlers[req](whom, fsreq);
+			r = handlers[req](whom, args);
 		} else {
 			cprintf("Invalid request code %d from %08x\n", whom, req);
 			r = -E_INVAL;
 		}
-		ipc_send(whom, r, pg, perm);
-		sys_page_unmap(0, fsreq);
+		reply_pg.ip_npages = (pg != NULL);
+		reply_pg.ip_perm = perm;
+		reply_pg.ip_va[0] = pg;
+		reply = 1;
 	}
 }
 
@@ -6,6 +6,7 @@
 #include <inc/types.h>
 #include <inc/trap.h>
 #include <inc/memlayout.h>
+#include <inc/syscall.h>
 
 typedef int32_t envid_t;
 
@@ -40,14 +41,38 @@ enum {
 
 extern char *env_status_msg[];
 
+// Scheduling priority levels.  Lower levels are scheduled first.
+#define NPRIO			4
+#define ENV_PRIO_HIGH		0
+#define ENV_PRIO_NORMAL		1
+#define ENV_PRIO_LOW		(NPRIO - 1)
+
+// Per-CPU scheduler statistics, as returned by sys_sched_stats.
+// Times are in TSC cycles.  Bucket i of the wait histogram counts
+// run queue waits of [2^i, 2^(i+1)) cycles; the last bucket also
+// counts anything longer.
+#define SCHED_HIST_BUCKETS	32
+
+struct SchedStats {
+	uint64_t ss_idle_cycles;		// Time spent halted
+	uint32_t ss_handoffs;			// IPCs that switched straight to
+						// the receiver (sched_handoff)
+	uint32_t ss_wait_hist[SCHED_HIST_BUCKETS];
+};
+
 // Special environment types
 enum EnvType {
 	ENV_TYPE_USER = 0,
-	ENV_TYPE_IDLE,
 	ENV_TYPE_FS,		// File system server
 	ENV_TYPE_NS,		// Network server
 };
 
+// Envs blocked in sys_ipc_send on one receiver, oldest first.
+struct IpcSendq {
+	struct Env *sq_head;
+	struct Env *sq_tail;
+};
+
 struct Env {
 	struct Trapframe env_tf;	// Saved registers
 	struct Env *env_link;		// Next free Env
@@ -58,8 +83,27 @@ struct Env {
 	uint32_t env_runs;		// Number of times environment has run
 	int env_cpunum;			// The CPU that the env is running on
 
+	// Scheduling
+	struct Env *env_rq_next;	// Next env on its run queue
+	struct Env *env_rq_prev;	// Previous env on its run queue
+	int env_rq_cpu;			// CPU whose run queue holds the env, or -1
+	int env_affinity;		// CPU the env is pinned to, or -1
+	int env_prio;			// Current priority level
+	int env_base_prio;		// Static priority: the best level it gets
+	uint32_t env_slice_ticks;	// Timer ticks run at its current level
+
+	// Scheduler accounting, in TSC cycles
+	uint64_t env_run_cycles;	// Time spent running
+	uint64_t env_wait_cycles;	// Time spent ENV_RUNNABLE on a run queue
+	uint64_t env_tsc_stamp;		// When it last started running or waiting
+	uint32_t env_vol_switches;	// Times it blocked or yielded
+	uint32_t env_invol_switches;	// Times it was preempted
+
 	// Address space
 	pde_t *env_pgdir;		// Kernel virtual address of page dir
+	uintptr_t env_umc_start;	// Range last passed by user_mem_check
+	uintptr_t env_umc_end;		// ... while running: valid while
+	int env_umc_perm;		// PDE_UMC_VALID is set (kern/pmap.h)
 
 	// Exception handling
 	void *env_pgfault_upcall;	// Page fault upcall entry point
@@ -67,9 +111,28 @@ struct Env {
 	// Lab 4 IPC
 	bool env_ipc_recving;		// Env is blocked receiving
 	void *env_ipc_dstva;		// VA at which to map received page
+	uint32_t env_ipc_dstpages;	// Pages the window at dstva holds
 	uint32_t env_ipc_value;		// Data value sent to us
+	uint32_t env_ipc_regs[IPC_NREGS]; // ... and the words after it
 	envid_t env_ipc_from;		// envid of the sender
 	int env_ipc_perm;		// Perm of page mapping received
+	uint32_t env_ipc_npages;	// Number of pages received
+	struct IpcSendq env_ipc_sendq;	// Envs blocked sending to us
+	struct IpcSendq *env_ipc_sendq_on; // Send queue we are blocked on
+	struct Env *env_ipc_sq_next;	// Next and previous env on that
+	struct Env *env_ipc_sq_prev;	// ... send queue
+	uint32_t env_ipc_send_value;	// The message we are blocked sending
+	uint32_t env_ipc_send_regs[IPC_NREGS];
+	struct IpcPages env_ipc_send_pages;
+	uint32_t env_ipc_send_deadline;	// time_msec() to give up at, or 0
+
+	// Notifications
+	uint32_t env_notify_pending;	// Signals posted and not yet taken
+	bool env_notify_waiting;	// Env is blocked in sys_wait_notify
+	uint32_t env_notify_mask;	// ... for these signals
+	uint32_t env_notify_deadline;	// ... until time_msec() is this, or 0
+	struct Env *env_notify_next;	// Next env on the list to wake
+	bool env_notify_queued;		// Env is on that list
 	
 	// Net
 	bool env_net_recving; // Env is blocked receiving
@@ -63,8 +63,12 @@ struct Super {
 enum {
 	FSREQ_OPEN = 1,
 	FSREQ_SET_SIZE,
-	// Read returns a Fsret_read on the request page
+	// Read returns a Fsret_read on the request page, or, if the
+	// client sent data pages after the request page, the data in
+	// those pages
 	FSREQ_READ,
+	// Write takes the data from req_buf, or from the data pages
+	// sent after the request page, if any
 	FSREQ_WRITE,
 	// Stat returns a Fsret_stat on the request page
 	FSREQ_STAT,
@@ -73,6 +77,12 @@ enum {
 	FSREQ_SYNC
 };
 
+// Requests whose arguments fit in the IPC_NREGS words of a register
+// message (see ipc_call_regs): they go without a request page.
+#define FSREQ_REGS(type) \
+	((type) == FSREQ_SET_SIZE || (type) == FSREQ_FLUSH \
+	 || (type) == FSREQ_SYNC)
+
 union Fsipc {
 	struct Fsreq_open {
 		char req_path[MAXPATHLEN];
@@ -22,6 +22,7 @@
 #include <inc/args.h>
 #include <inc/malloc.h>
 #include <inc/ns.h>
+#include <inc/time.h>
 
 #define USED(x)		(void)(x)
 
@@ -33,10 +34,22 @@ extern const char *binaryname;
 extern const volatile struct Env *thisenv;
 extern const volatile struct Env envs[NENV];
 extern const volatile struct Page pages[];
+extern const volatile struct TimePage timepage;
 
 // exit.c
 void	exit(void);
 
+// batch.c
+extern struct SyscallDesc batch_descs[SYSBATCH_MAX];
+int	batch_add(uint32_t num, uint32_t a1, uint32_t a2, uint32_t a3,
+		  uint32_t a4, uint32_t a5);
+int	batch_flush(void);
+
+// time.c
+unsigned int time_msec(void);
+uint64_t time_usec(void);
+uint64_t time_ns(void);
+
 // pgfault.c
 void	set_pgfault_handler(void (*handler)(struct UTrapframe *utf));
 
@@ -63,6 +76,28 @@ unsigned int sys_time_msec(void);
 int sys_net_send(void *buf, int len);
 int sys_net_recv(void *buf, int bufsize, int *packet_size);
 int sys_net_read_mac_addr(void *buf);
+int	sys_env_set_affinity(envid_t env, int cpu);
+int	sys_env_set_priority(envid_t env, int prio);
+int	sys_sched_stats(int cpu, struct SchedStats *stats);
+uint64_t sys_time_usec(void);
+uint64_t sys_time_ns(void);
+int	sys_batch(struct SyscallDesc *descs, uint32_t n);
+envid_t	sys_fork(void);
+int	sys_superpage_alloc(envid_t env, void *va, int perm);
+int	sys_ipc_send(envid_t to_env, uint32_t value, void *pg, int perm,
+		     unsigned timeout);
+int	sys_ipc_sendv(envid_t to_env, uint32_t value,
+		      const struct IpcPages *pg, unsigned timeout);
+int	sys_ipc_recvv(void *rcv_pg, unsigned npages);
+int	sys_ipc_send_recv(envid_t to_env, uint32_t value,
+			  const struct IpcPages *pg, void *rcv_pg,
+			  unsigned rcv_npages);
+int	sys_ipc_send_regs(envid_t to_env, uint32_t value, uint32_t w1,
+			  uint32_t w2, uint32_t w3);
+int	sys_ipc_call_regs(envid_t to_env, uint32_t value, uint32_t w1,
+			  uint32_t w2, uint32_t w3);
+int	sys_notify(envid_t env, uint32_t bits);
+uint32_t sys_wait_notify(uint32_t mask, unsigned timeout);
 
 // This must be inlined.  Exercise for reader: why?
 static __inline envid_t __attribute__((always_inline))
@@ -80,10 +115,27 @@ sys_exofork(void)
 // ipc.c
 void	ipc_send(envid_t to_env, uint32_t value, void *pg, int perm);
 int32_t ipc_recv(envid_t *from_env_store, void *pg, int *perm_store);
+void	ipc_sendv(envid_t to_env, uint32_t value, const struct IpcPages *pg);
+int32_t ipc_recvv(envid_t *from_env_store, void *pg, unsigned npages,
+		  int *perm_store);
+int32_t ipc_call(envid_t to_env, uint32_t value, void *pg, int perm,
+		 envid_t *from_env_store, void *rcv_pg, int *perm_store);
+int32_t ipc_callv(envid_t to_env, uint32_t value, const struct IpcPages *pg,
+		  envid_t *from_env_store, void *rcv_pg, unsigned rcv_npages,
+		  int *perm_store);
+int32_t ipc_call_regs(envid_t to_env, uint32_t value,
+		      const uint32_t regs[IPC_NREGS], envid_t *from_env_store);
+int	ipc_data_map(size_t n);
+int	ipc_data_pages(struct IpcPages *pg, size_t n);
+
+// Bulk data for the file and network servers travels in up to
+// IPCDATA_NPAGES pages at IPCDATA, just below the file descriptor
+// table (see lib/fd.c), sent along with the request page.
+#define IPCDATA_NPAGES	16
+#define IPCDATA		(0xD0000000 - IPCDATA_NPAGES * PGSIZE)
 envid_t	ipc_find_env(enum EnvType type);
 
 // fork.c
-#define	PTE_SHARE	0x400
 envid_t	fork(void);
 envid_t	sfork(void);	// Challenge!
 
@@ -52,7 +52,8 @@
  *    UVPT      ---->  +------------------------------+ 0xef400000
  *                     |          RO PAGES            | R-/R-  PTSIZE
  *    UPAGES    ---->  +------------------------------+ 0xef000000
- *                     |           RO ENVS            | R-/R-  PTSIZE
+ *                     |  RO TIME (top page of slot)  | R-/R-  PTSIZE
+ *                     |           RO ENVS            |
  * UTOP,UENVS ------>  +------------------------------+ 0xeec00000
  * UXSTACKTOP -/       |     User Exception Stack     | RW/RW  PGSIZE
  *                     +------------------------------+ 0xeebff000
@@ -115,6 +116,9 @@
 #define UPAGES		(UVPT - PTSIZE)
 // Read-only copies of the global env structures
 #define UENVS		(UPAGES - PTSIZE)
+// Read-only copy of the kernel's clock (struct TimePage), in the
+// top page of the UENVS slot
+#define UTIME		(UPAGES - PGSIZE)
 
 /*
  * Top of user VM. User can manipulate VA from UTOP-1 and down!
@@ -182,8 +186,9 @@ extern volatile pde_t vpd[];     // VA of current page directory
  * with page2pa() in kern/pmap.h.
  */
 struct Page {
-	// Next page on the free list.
+	// Next and previous page on the free list.
 	struct Page *pp_link;
+	struct Page *pp_prev;
 
 	// pp_ref is the count of pointers (usually in page table entries)
 	// to this page, for pages allocated using page_alloc.
@@ -191,6 +196,12 @@ struct Page {
 	// boot_alloc do not have valid reference count fields.
 
 	uint16_t pp_ref;
+
+	// For the first page of a block on the buddy allocator's free
+	// lists: pp_free is set and pp_order is log2 of the block's size
+	// in pages.  Zero for every other page.
+	uint8_t pp_order;
+	uint8_t pp_free;
 };
 
 #endif /* !__ASSEMBLER__ */
@@ -14,7 +14,8 @@ struct jif_pkt {
 
 // Definitions for requests from clients to network server
 enum {
-	// The following messages pass a page containing an Nsipc.
+	// The following messages pass a page containing an Nsipc,
+	// but see NSREQ_REGS.
 	// Accept returns a Nsret_accept on the request page.
 	NSREQ_ACCEPT = 1,
 	NSREQ_BIND,
@@ -37,6 +38,12 @@ enum {
 	NSREQ_TIMER,
 };
 
+// Requests whose Nsipc fits in the IPC_NREGS words of a register
+// message (see ipc_call_regs): they go without a request page.
+#define NSREQ_REGS(type) \
+	((type) == NSREQ_SHUTDOWN || (type) == NSREQ_CLOSE \
+	 || (type) == NSREQ_LISTEN || (type) == NSREQ_SOCKET)
+
 union Nsipc {
 	struct Nsreq_accept {
 		int req_s;
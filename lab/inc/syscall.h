@@ -1,6 +1,9 @@
 #ifndef JOS_INC_SYSCALL_H
 #define JOS_INC_SYSCALL_H
 
+#include <inc/types.h>
+#include <inc/mmu.h>
+
 /* system call numbers */
 enum {
 	SYS_cputs = 0,
@@ -21,7 +24,59 @@ enum {
 	SYS_net_send,
 	SYS_net_recv,
 	SYS_net_read_mac_addr,
+	SYS_env_set_affinity,
+	SYS_env_set_priority,
+	SYS_sched_stats,
+	SYS_time_usec,
+	SYS_time_ns,
+	SYS_batch,
+	SYS_fork,
+	SYS_superpage_alloc,
+	SYS_ipc_send_recv,
+	SYS_ipc_send,
+	SYS_ipc_sendv,
+	SYS_ipc_recvv,
+	SYS_ipc_send_regs,
+	SYS_ipc_call_regs,
+	SYS_notify,
+	SYS_wait_notify,
 	NSYSCALLS
 };
 
+// Timeouts for sys_ipc_send and sys_wait_notify, in milliseconds,
+// other than these two
+#define IPC_NOWAIT	0		// Fail at once if the receiver isn't
+					// waiting, as sys_ipc_try_send does
+#define IPC_FOREVER	((unsigned) -1)	// Wait as long as it takes
+
+// Signals (see sys_notify) that the kernel posts.  Envs agree among
+// themselves on what the other bits mean.
+#define NOTIFY_CHILD	0x1		// A child env exited
+
+// Most pages one IPC message can carry
+#define IPC_MAXPAGES	32
+
+// Words an IPC message carries besides its value, in the registers of
+// sys_ipc_send_regs and sys_ipc_call_regs
+#define IPC_NREGS	3
+
+// The pages of an IPC message sent with sys_ipc_sendv, all with the
+// same permissions.  The receiver gets them mapped one after another.
+struct IpcPages {
+	uint32_t ip_npages;		// Number of pages in ip_va
+	int ip_perm;			// Their permissions
+	void *ip_va[IPC_MAXPAGES];	// Where they are mapped in the sender
+};
+
+// One system call in a batch submitted with sys_batch.
+struct SyscallDesc {
+	uint32_t sd_num;		// System call number
+	uint32_t sd_args[5];		// Its arguments
+	int32_t sd_ret;			// Its result, stored by the kernel
+	uint32_t sd_reserved;		// Pads the structure to 32 bytes
+};
+
+// Maximum number of system calls in one batch: one page's worth
+#define SYSBATCH_MAX	(PGSIZE / sizeof(struct SyscallDesc))
+
 #endif /* !JOS_INC_SYSCALL_H */
@@ -0,0 +1,39 @@
+#ifndef JOS_INC_TIME_H
+#define JOS_INC_TIME_H
+
+#include <inc/types.h>
+
+// Timer interrupts per second on each CPU
+#define TIMER_HZ	100
+
+// The kernel's clock, mapped read-only at UTIME in every environment
+// so that reading the time needs no system call.  Only tp_ticks
+// changes after boot; the rest is set before any environment runs.
+struct TimePage {
+	volatile uint32_t tp_ticks;	// Timer ticks since boot
+	uint64_t tp_tsc_boot;		// TSC at boot
+	uint64_t tp_tsc_hz;		// TSC cycles per second, or 0
+};
+
+// Milliseconds since boot, in timer ticks.
+static __inline uint32_t
+timepage_msec(const volatile struct TimePage *tp)
+{
+	return tp->tp_ticks * (1000 / TIMER_HZ);
+}
+
+// Nanoseconds since boot, given the current TSC value 'tsc'.
+static __inline uint64_t
+timepage_ns(const volatile struct TimePage *tp, uint64_t tsc)
+{
+	uint64_t delta, sec, hz = tp->tp_tsc_hz;
+
+	if (!hz)
+		return (uint64_t) tp->tp_ticks * (1000000000 / TIMER_HZ);
+	// Split off whole seconds so that delta * 10^9 can't overflow.
+	delta = tsc - tp->tp_tsc_boot;
+	sec = delta / hz;
+	return sec * 1000000000 + (delta - sec * hz) * 1000000000 / hz;
+}
+
+#endif /* !JOS_INC_TIME_H */
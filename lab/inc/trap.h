@@ -27,6 +27,7 @@
 // These are arbitrarily chosen, but with care not to overlap
 // processor defined exceptions or interrupt vectors.
 #define T_SYSCALL   48		// system call
+#define T_SYSENTER  49		// system call via sysenter (not an IDT vector)
 #define T_DEFAULT   500		// catchall
 
 #define IRQ_OFFSET	32	// IRQ 0 corresponds to int IRQ_OFFSET
@@ -39,6 +40,8 @@
 #define IRQ_NETWORK     11
 #define IRQ_IDE         14
 #define IRQ_ERROR       19
+#define IRQ_WAKEUP      20	// IPI that wakes a CPU halted in sched_halt
+#define IRQ_TLB         21	// IPI asking a CPU to invalidate TLB entries
 
 #ifndef __ASSEMBLER__
 
@@ -20,6 +20,9 @@
 void cons_init(void);
 int cons_getc(void);
 
+// Serializes cprintf output and the console input buffer across CPUs.
+extern struct spinlock cons_lock;
+
 void kbd_intr(void); // irq 1
 void serial_intr(void); // irq 4
 
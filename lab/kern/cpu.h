@@ -6,6 +6,7 @@
 #include <inc/memlayout.h>
 #include <inc/mmu.h>
 #include <inc/env.h>
+#include <kern/spinlock.h>
 
 // Maximum number of CPUs
 #define NCPU  8
@@ -16,12 +17,58 @@ enum {
 	CPU_STARTED,
 };
 
+// Multi-level feedback queue of ENV_RUNNABLE environments: one FIFO per
+// priority level, linked through env_rq_next and env_rq_prev.
+struct Runq {
+	struct spinlock rq_lock;
+	struct Env *rq_head[NPRIO];
+	struct Env *rq_tail[NPRIO];
+	int rq_len;			// Envs queued on all levels
+	int rq_ticks;			// Timer ticks since the last boost
+};
+
+// Free pages that page_alloc and page_free keep on one CPU, in front
+// of the shared buddy allocator.  Other CPUs only take them back when
+// the buddy allocator runs dry, so pc_lock is almost never contended.
+struct PageCache {
+	struct spinlock pc_lock;
+	struct Page *pc_head;
+	int pc_count;
+};
+
+// Most pages one TLB shootdown invalidates one by one; a bigger batch
+// flushes the whole address space instead.
+#define TLB_BATCH_MAX	16
+
+// TLB invalidations this CPU owes the other CPUs that have an address
+// space loaded, collected between tlb_batch_begin and tlb_batch_end so
+// that they go out in one IPI round.  Only this CPU touches it.
+struct TlbBatch {
+	int tb_depth;			// Nesting of tlb_batch_begin
+	pde_t *tb_pgdir;		// Address space of tb_va
+	uint32_t tb_cpus;		// Bitmask of the CPUs to interrupt
+	int tb_count;			// Pages in tb_va; more than
+					// TLB_BATCH_MAX means all of them
+	uintptr_t tb_va[TLB_BATCH_MAX];
+	struct Page *tb_free;		// Pages to free once they are sent
+};
+
 // Per-CPU state
 struct Cpu {
 	uint8_t cpu_id;                 // Local APIC ID; index into cpus[] below
 	volatile unsigned cpu_status;   // The status of the CPU
 	struct Env *cpu_env;            // The currently-running environment.
 	struct Taskstate cpu_ts;        // Used by x86 to find stack for interrupt
+	struct Runq cpu_runq;           // Runnable envs waiting for this CPU
+	volatile uint32_t cpu_halted;   // Halted in sched_halt, or about to
+	uint64_t cpu_halt_stamp;        // TSC when it halted, or 0
+	struct SchedStats cpu_stats;    // Written only by this CPU
+	struct PageCache cpu_pcache;    // Free single pages
+	pde_t *cpu_pgdir;               // Page directory loaded in CR3
+	volatile uint32_t cpu_tlb_pending; // Owes a TLB shootdown
+	struct TlbBatch cpu_tlb;        // Shootdowns this CPU owes others
+	bool cpu_sysenter_tf;           // The env in sysenter had TF set
+	bool cpu_preempted;             // sched_tick asked to preempt curenv
 };
 
 // Initialized in mpconfig.c
@@ -41,5 +88,9 @@ void lapic_init(void);
 void lapic_startap(uint8_t apicid, uint32_t addr);
 void lapic_eoi(void);
 void lapic_ipi(int vector);
+void lapic_ipi_cpu(uint8_t apicid, int vector);
+void lapic_timer_calibrate(void);
+uint32_t lapic_timer_count(void);
+void lapic_timer_start(uint32_t ticr);
 
 #endif
@@ -63,6 +63,7 @@ __attribute__ ((aligned(2048)));
 
 struct Env *suspend_env = NULL; //store the environment suspended by empty 
 								//receive buffer
+struct spinlock e1000_lock;
 
 static uint32_t
 pcibar0r(int index)
@@ -287,6 +288,7 @@ e1000_attach(struct pci_func *pcif)
 	// Register) 0.
 	if (debug) 
 		cprintf("start e1000_attach\n");
+	spin_initlock(&e1000_lock);
 	pci_func_enable(pcif);
 	
 	assert(pcif->reg_base[0]);
@@ -302,7 +304,7 @@ e1000_attach(struct pci_func *pcif)
 		if (!(ptep = pgdir_walk(kern_pgdir, (void *)va_addr, 1)))
 			panic("out of memory!");
 		//perm: kernel RW, user None
-		*ptep = phy_addr | PTE_P | PTE_W | PTE_PCD | PTE_PWT;
+		*ptep = phy_addr | PTE_P | PTE_W | PTE_PCD | PTE_PWT | PTE_G;
 	}
 	
 	pci_bar0 = (uint32_t *)PCI_BAR0;
@@ -388,27 +390,39 @@ e1000_interrupt_handler()
 	//cprintf("interrupt!!!!\n");
 	pcibar0r(ICR);
 
-	if (!suspend_env) {
+	struct Env *e;
+	pde_t *pgdir;
+
+	spin_lock(&e1000_lock);
+	if (!(e = suspend_env)) {
+		spin_unlock(&e1000_lock);
 		cprintf("suspend_env is NULL\n");
 		sched_yield();
 		return;
 	}
 	
-	assert(suspend_env->env_net_recving);
-
-	lcr3(PADDR(suspend_env->env_pgdir));
-
-	if (e1000_rx(suspend_env->env_net_buf, 
-				 suspend_env->env_net_buf_size,
-				 suspend_env->env_net_packet_size_store) < 0)
-		panic("receive packet receive interrupt, but e1000_rx return error!");
+	// The waiter may have been destroyed since it blocked;
+	// env_free clears env_net_recving.
+	env_lock(e);
+	if (e->env_net_recving) {
+		if ((pgdir = thiscpu->cpu_pgdir) != e->env_pgdir)
+			pgdir_load(e->env_pgdir);
+
+		if (e1000_rx(e->env_net_buf, 
+					 e->env_net_buf_size,
+					 e->env_net_packet_size_store) < 0)
+			panic("receive packet receive interrupt, but e1000_rx return error!");
+			
+		if (pgdir != e->env_pgdir)
+			pgdir_load(pgdir);
 		
-	lcr3(PADDR(curenv->env_pgdir)); 
-	
-	suspend_env->env_net_recving = 0;
-	suspend_env->env_tf.tf_regs.reg_eax = 0;
-	suspend_env->env_status = ENV_RUNNABLE;
+		e->env_net_recving = 0;
+		e->env_tf.tf_regs.reg_eax = 0;
+		sched_enqueue(e);
+	}
+	env_unlock(e);
 	suspend_env = NULL;
+	spin_unlock(&e1000_lock);
 	
 	//clear the receive handler
 	sched_yield();
@@ -5,6 +5,7 @@
 #define E1000_PCI_PRODUCT  0x100e
 
 #include <kern/pci.h>
+#include <kern/spinlock.h>
 
 int e1000_attach(struct pci_func *pcif);
 int e1000_tx(uint8_t *buf, int len);
@@ -12,4 +13,7 @@ int e1000_rx(uint8_t *buf, int bufsize, int *packet_size);
 int e1000_read_mac_addr(uint8_t *buf);
 void e1000_interrupt_handler();
 extern struct Env *suspend_env;
+
+// Protects the descriptor rings and suspend_env.
+extern struct spinlock e1000_lock;
 #endif	// JOS_KERN_E1000_H
@@ -12,12 +12,18 @@
 #include <kern/trap.h>
 #include <kern/monitor.h>
 #include <kern/sched.h>
+#include <kern/syscall.h>
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
 
 struct Env *envs = NULL;		// All environments
 static struct Env *env_free_list;	// Free environment list
 					// (linked by Env->env_link)
+static struct spinlock env_table_lock;	// Protects env_free_list
+
+// Per-environment locks, indexed like envs[].  They live outside
+// struct Env because envs[] is mapped read-only into user space.
+static struct spinlock env_locks[NENV];
 
 #define ENVGENSHIFT	12		// >= LOGNENV
 
@@ -71,6 +77,47 @@ char *env_status_msg[5] = {
 	"NOT_RUNNABLE"
 };
 
+//
+// Acquire e's lock.  It protects e's address space, its IPC and
+// network-receive state, and its env_status transitions.
+// When two env locks are needed, use env_lock_pair.
+//
+void
+env_lock(struct Env *e)
+{
+	spin_lock(&env_locks[e - envs]);
+}
+
+void
+env_unlock(struct Env *e)
+{
+	spin_unlock(&env_locks[e - envs]);
+}
+
+// Acquire the locks of a and b (which may be the same env),
+// always in envs[] index order to avoid deadlock.
+void
+env_lock_pair(struct Env *a, struct Env *b)
+{
+	if (a == b)
+		env_lock(a);
+	else if (a < b) {
+		env_lock(a);
+		env_lock(b);
+	} else {
+		env_lock(b);
+		env_lock(a);
+	}
+}
+
+void
+env_unlock_pair(struct Env *a, struct Env *b)
+{
+	env_unlock(a);
+	if (a != b)
+		env_unlock(b);
+}
+
 //
 // Converts an envid to an env pointer.
 // If checkperm is set, the specified environment must be either the
@@ -117,6 +164,55 @@ envid2env(envid_t envid, struct Env **env_store, bool checkperm)
 	return 0;
 }
 
+//
+// Like envid2env, but on success returns with the env's lock held.
+// The lookup is repeated under the lock, so the env cannot be freed
+// or reused until the caller calls env_unlock.
+//
+int
+envid2env_lock(envid_t envid, struct Env **env_store, bool checkperm)
+{
+	struct Env *e;
+	int r;
+
+	if ((r = envid2env(envid, &e, checkperm)) < 0) {
+		*env_store = 0;
+		return r;
+	}
+	env_lock(e);
+	if (e->env_status == ENV_FREE || (envid && e->env_id != envid)) {
+		env_unlock(e);
+		*env_store = 0;
+		return -E_BAD_ENV;
+	}
+	*env_store = e;
+	return 0;
+}
+
+//
+// Look up two envids as envid2env does and acquire both envs' locks
+// (see env_lock_pair).  The envids may name the same env.
+//
+int
+envid2env_lock_pair(envid_t id1, struct Env **e1_store,
+		    envid_t id2, struct Env **e2_store, bool checkperm)
+{
+	struct Env *e1, *e2;
+
+	if (envid2env(id1, &e1, checkperm) < 0
+	    || envid2env(id2, &e2, checkperm) < 0)
+		return -E_BAD_ENV;
+	env_lock_pair(e1, e2);
+	if (e1->env_status == ENV_FREE || (id1 && e1->env_id != id1)
+	    || e2->env_status == ENV_FREE || (id2 && e2->env_id != id2)) {
+		env_unlock_pair(e1, e2);
+		return -E_BAD_ENV;
+	}
+	*e1_store = e1;
+	*e2_store = e2;
+	return 0;
+}
+
 // Mark all environments in 'envs' as free, set their env_ids to 0,
 // and insert them into the env_free_list.
 // Make sure the environments are in the free list in the same order
@@ -129,11 +225,14 @@ env_init(void)
 	int i;
 	// Set up envs array
 	// LAB 3: Your code here.
+	spin_initlock(&env_table_lock);
 	env_free_list = envs;
 	for (i=0; i < NENV; i++) {
+		spin_initlock(&env_locks[i]);
 		memset(envs + i, 0, sizeof(struct Env));
 		envs[i].env_id = 0;
 		envs[i].env_tf.tf_eflags =0x00000202; //enable EF_IF
+		envs[i].env_rq_cpu = -1;
 		//TODO: I'm not sure that env_link is linked by this way!
 		if (i+1 < NENV)
 			envs[i].env_link = envs + i + 1;
@@ -177,7 +276,7 @@ env_init_percpu(void)
 static int
 env_setup_vm(struct Env *e)
 {
-	int i,j,r;
+	int i;
 	struct Page *p = NULL;
 
 	// Allocate a page for the page directory
@@ -204,31 +303,11 @@ env_setup_vm(struct Env *e)
 	p->pp_ref++;
 	e->env_pgdir = (pde_t *)page2kva(p);
 	
-	extern pde_t *kern_pgdir;
-	for (i=0; i<NPTENTRIES; i++){
-		//page talbe copy
-		pde_t pde = kern_pgdir[i];
-		uintptr_t base_addr = i * PTSIZE;
-		if (pde & PTE_P) {
-			if (pde & PTE_PS){
-				e->env_pgdir[i] = pde;
-			} else {
-				for (j=0; j<NPTENTRIES; j++) {
-					uintptr_t addr = base_addr + j * PGSIZE;
-					pte_t *ptep_src = NULL, *ptep_dst = NULL;
-					ptep_src = pgdir_walk(kern_pgdir, (void *)addr, 0);
-					if (ptep_src && *ptep_src) {
-						ptep_dst = pgdir_walk(e->env_pgdir, (void *)addr, 1);
-						if (!ptep_dst)
-							panic("env_setup_vm: out of memory!");
-						*ptep_dst = *ptep_src;
-					}
-				}
-			}
-		} else {
-		    e->env_pgdir[i] = 0;
-		}
-	}
+	// Share the kernel's page tables (and superpages) above UTOP, so
+	// every env maps the kernel through the same, PTE_G, entries.
+	// env_free only frees page tables below UTOP.
+	for (i = PDX(UTOP); i < NPDENTRIES; i++)
+		e->env_pgdir[i] = kern_pgdir[i];
 	
 	// UVPT maps the env's own page table read-only.
 	// Permissions: kernel R, user R
@@ -255,12 +334,23 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	int r;
 	struct Env *e;
 
-	if (!(e = env_free_list))
+	spin_lock(&env_table_lock);
+	if (!(e = env_free_list)) {
+		spin_unlock(&env_table_lock);
 		return -E_NO_FREE_ENV;
+	}
+	env_free_list = e->env_link;
+	spin_unlock(&env_table_lock);
 
 	// Allocate and set up the page directory for this environment.
-	if ((r = env_setup_vm(e)) < 0)
+	if ((r = env_setup_vm(e)) < 0) {
+		spin_lock(&env_table_lock);
+		e->env_link = env_free_list;
+		env_free_list = e;
+		spin_unlock(&env_table_lock);
 		return r;
+	}
+	env_lock(e);
 
 	// Generate an env_id for this environment.
 	generation = (e->env_id + (1 << ENVGENSHIFT)) & ~(NENV - 1);
@@ -271,8 +361,12 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	// Set the basic status variables.
 	e->env_parent_id = parent_id;
 	e->env_type = ENV_TYPE_USER;
-	e->env_status = ENV_RUNNABLE;
 	e->env_runs = 0;
+	e->env_affinity = -1;
+	e->env_prio = e->env_base_prio = ENV_PRIO_NORMAL;
+	e->env_slice_ticks = 0;
+	e->env_run_cycles = e->env_wait_cycles = 0;
+	e->env_vol_switches = e->env_invol_switches = 0;
 
 	// Clear out all the saved register state,
 	// to prevent the register values
@@ -304,9 +398,19 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 
 	// Also clear the IPC receiving flag.
 	e->env_ipc_recving = 0;
-
-	// commit the allocation
-	env_free_list = e->env_link;
+	e->env_net_recving = 0;
+
+	// A notify_post that raced with the previous env's teardown may
+	// have left signals behind; notify_post skips e while it is
+	// ENV_FREE, so they can be cleared without notify_lock.
+	e->env_notify_pending = 0;
+	e->env_notify_mask = 0;
+
+	// The new environment is not runnable until its creator has
+	// finished setting it up (env_create, or the user-level
+	// sys_exofork protocol), so no other CPU can pick it up early.
+	e->env_status = ENV_NOT_RUNNABLE;
+	env_unlock(e);
 	*newenv_store = e;
 
 	//cprintf("[%08x] new env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
@@ -400,7 +504,7 @@ load_icode(struct Env *e, uint8_t *binary, size_t size)
 	//  What?  (See env_run() and env_pop_tf() below.)
 
 	// LAB 3: Your code here.
-	lcr3(PADDR(e->env_pgdir));
+	pgdir_load(e->env_pgdir);
 	struct Proghdr *ph, *eph;
 	struct Elf *elf_hdr = (struct Elf *)binary;
 
@@ -434,7 +538,7 @@ load_icode(struct Env *e, uint8_t *binary, size_t size)
 		panic("out of memory!\n");
 	page_insert(e->env_pgdir, page, (void *)(USTACKTOP - PGSIZE), PTE_U | PTE_W);
 	
-	lcr3(PADDR(kern_pgdir));
+	pgdir_load(kern_pgdir);
 }
 
 //
@@ -454,16 +558,27 @@ env_create(uint8_t *binary, size_t size, enum EnvType type)
 		panic("env_alloc: %e");
 	load_icode(env, binary, size);
 	env->env_type = type;
+
 	
 	// If this is the file server (type == ENV_TYPE_FS) give it I/O privileges.
 	// LAB 5: Your code here.
 	if (type == ENV_TYPE_FS) 
 		env->env_tf.tf_eflags |= FL_IOPL_3;
-		
+
+	// The file and network servers sit on the request path of
+	// every other environment, so serve them ahead of batch work.
+	if (type == ENV_TYPE_FS || type == ENV_TYPE_NS)
+		env->env_prio = env->env_base_prio = ENV_PRIO_HIGH;
+
+	// Now let it run.
+	env_lock(env);
+	sched_enqueue(env);
+	env_unlock(env);
 }
 
 //
 // Frees env e and all memory it uses.
+// The caller must hold e's lock.
 //
 void
 env_free(struct Env *e)
@@ -476,19 +591,30 @@ env_free(struct Env *e)
 	// before freeing the page directory, just in case the page
 	// gets reused.
 	if (e == curenv)
-		lcr3(PADDR(kern_pgdir));
+		pgdir_load(kern_pgdir);
 
 	// Note the environment's demise.
 	//cprintf("[%08x] free env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
 
 	// Flush all mapped pages in the user portion of the address space
 	static_assert(UTOP % PTSIZE == 0);
+	tlb_batch_begin();
 	for (pdeno = 0; pdeno < PDX(UTOP); pdeno++) {
 
 		// only look at mapped page tables
 		if (!(e->env_pgdir[pdeno] & PTE_P))
 			continue;
 
+		// a superpage has no page table
+		if (e->env_pgdir[pdeno] & PTE_PS) {
+			page_remove(e->env_pgdir, PGADDR(pdeno, 0, 0));
+			continue;
+		}
+
+		// a page table still shared with another env is theirs now
+		if (pgtable_release(e->env_pgdir, pdeno))
+			continue;
+
 		// find the pa and va of the page table
 		pa = PTE_ADDR(e->env_pgdir[pdeno]);
 		pt = (pte_t*) KADDR(pa);
@@ -501,8 +627,9 @@ env_free(struct Env *e)
 
 		// free the page table itself
 		e->env_pgdir[pdeno] = 0;
-		page_decref(pa2page(pa));
+		pgtable_decref(pa2page(pa));
 	}
+	tlb_batch_end();
 
 	// free the page directory
 	pa = PADDR(e->env_pgdir);
@@ -510,9 +637,15 @@ env_free(struct Env *e)
 	page_decref(pa2page(pa));
 
 	// return the environment to the free list
+	sched_dequeue(e);
+	ipc_env_free(e);
 	e->env_status = ENV_FREE;
+	e->env_ipc_recving = 0;
+	e->env_net_recving = 0;
+	spin_lock(&env_table_lock);
 	e->env_link = env_free_list;
 	env_free_list = e;
+	spin_unlock(&env_table_lock);
 }
 
 //
@@ -522,19 +655,35 @@ env_free(struct Env *e)
 //
 void
 env_destroy(struct Env *e)
+{
+	env_lock(e);
+	env_destroy_locked(e);
+}
+
+//
+// env_destroy for a caller that already holds e's lock, as
+// envid2env_lock returns it; the lock is released here.
+//
+void
+env_destroy_locked(struct Env *e)
 {
 	// If e is currently running on other CPUs, we change its state to
 	// ENV_DYING. A zombie environment will be freed the next time
 	// it traps to the kernel.
-	if (e->env_status == ENV_RUNNING && curenv != e) {
+	if ((e->env_status == ENV_RUNNING || e->env_status == ENV_DYING)
+	    && curenv != e) {
 		e->env_status = ENV_DYING;
+		env_unlock(e);
 		return;
 	}
 
 	env_free(e);
+	env_unlock(e);
 
 	if (curenv == e) {
 		curenv = NULL;
+		// Wake the parent if it waits for us to exit.
+		notify_flush();
 		sched_yield();
 	}
 }
@@ -552,6 +701,27 @@ env_pop_tf(struct Trapframe *tf)
 	// Record the CPU we are running on for user-space debugging
 	curenv->env_cpunum = cpunum();
 
+	// Return from sysenter with sysexit, which jumps to %edx with
+	// %esp = %ecx; the user stub expects both to be clobbered.
+	// Restore eflags with IF still clear, so no interrupt can
+	// arrive while %esp points into tf; sti takes effect only after
+	// sysexit.  An env being single-stepped returns with iret, so
+	// TF never takes effect in the kernel.
+	if (tf->tf_trapno == T_SYSENTER && !(tf->tf_eflags & FL_TF))
+		__asm __volatile("movl %0,%%esp\n"
+			"\tpopal\n"
+			"\tpopl %%es\n"
+			"\tpopl %%ds\n"
+			"\taddl $0x8,%%esp\n" /* skip tf_trapno and tf_errcode */
+			"\tmovl (%%esp),%%edx\n" /* tf_eip */
+			"\tmovl 12(%%esp),%%ecx\n" /* tf_esp */
+			"\tpushl 8(%%esp)\n" /* tf_eflags, over tf_errcode */
+			"\tandl %1,(%%esp)\n"
+			"\tpopfl\n"
+			"\tsti\n"
+			"\tsysexit"
+			: : "g" (tf), "i" (~FL_IF) : "memory");
+
 	__asm __volatile("movl %0,%%esp\n"
 		"\tpopal\n"
 		"\tpopl %%es\n"
@@ -589,15 +759,31 @@ env_run(struct Env *e)
 	//	e->env_tf to sensible values.
 
 	// LAB 3: Your code here.
-	if (curenv && curenv->env_status == ENV_RUNNING)
-		curenv->env_status = ENV_RUNNABLE;
-	curenv = e;
-	e->env_status = ENV_RUNNING;
-	e->env_runs++;
-	lcr3(PADDR(e->env_pgdir));
-	
+	//
+	// The caller has already claimed e (see sched_yield), or e is
+	// curenv returning from a trap, so e is ENV_RUNNING here.
+	struct Env *prev = curenv;
 
-	unlock_kernel();
+	e->env_runs++;
+	if (prev != e) {
+		curenv = e;
+		// The kernel's PTE_G mappings stay in the TLB across the
+		// reload; skip it if e's page directory is still loaded.
+		if (rcr3() != PADDR(e->env_pgdir))
+			pgdir_load(e->env_pgdir);
+
+		// Only now that we are off prev's page directory may
+		// another CPU pick it up (or may we free it).
+		if (prev) {
+			env_lock(prev);
+			sched_stop(prev);
+			if (prev->env_status == ENV_RUNNING)
+				sched_enqueue(prev);
+			else if (prev->env_status == ENV_DYING)
+				env_free(prev);
+			env_unlock(prev);
+		}
+	}
 	
 	//cprintf("going to run %08x\n",e->env_id);
 	env_pop_tf(&e->env_tf);
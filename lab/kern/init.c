@@ -11,6 +11,7 @@
 #include <kern/env.h>
 #include <kern/trap.h>
 #include <kern/sched.h>
+#include <kern/syscall.h>
 #include <kern/picirq.h>
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
@@ -20,6 +21,10 @@
 
 static void boot_aps(void);
 
+// Set by the BSP once the initial environments exist; APs wait for
+// it before entering the scheduler.
+static volatile uint32_t boot_done;
+
 
 void
 i386_init(void)
@@ -40,6 +45,8 @@ i386_init(void)
 
 	// Lab 3 user environment initialization functions
 	env_init();
+	ipc_init();
+	sched_init();
 	trap_init();
 
 	// Lab 4 multiprocessor initialization functions
@@ -53,18 +60,9 @@ i386_init(void)
 	time_init();
 	pci_init();
 
-	// Acquire the big kernel lock before waking up APs
-	// Your code here:
-	lock_kernel();
-
 	// Starting non-boot CPUs
 	boot_aps();
 
-	// Should always have idle processes at first.
-	int i;
-	for (i = 0; i < NCPU; i++)
-		ENV_CREATE(user_idle, ENV_TYPE_IDLE);
-
 	// Start fs.
 	ENV_CREATE(fs_fs, ENV_TYPE_FS);
 
@@ -84,6 +82,9 @@ i386_init(void)
 	// Should not be necessary - drains keyboard because interrupt has given up.
 	kbd_intr();
 
+	// Let the APs into the scheduler.
+	xchg(&boot_done, 1);
+
 	// Schedule and run the first user environment!
 	sched_yield();
 }
@@ -125,10 +126,8 @@ void
 mp_main(void)
 {
 	// We are in high EIP now, safe to switch to kern_pgdir 
-	uint32_t cr4 = rcr4();
-	cr4 |= (1<<4); //Open PSE
-	lcr4(cr4);
-	lcr3(PADDR(kern_pgdir));
+	lcr4(rcr4() | CR4_PSE | CR4_PGE);
+	pgdir_load(kern_pgdir);
 	cprintf("SMP: CPU %d starting\n", cpunum());
 
 	lapic_init();
@@ -137,11 +136,10 @@ mp_main(void)
 	xchg(&thiscpu->cpu_status, CPU_STARTED); // tell boot_aps() we're up
 
 	// Now that we have finished some basic setup, call sched_yield()
-	// to start running processes on this CPU.  But make sure that
-	// only one CPU can enter the scheduler at a time!
-	//
-	// Your code here:
-	lock_kernel();
+	// to start running processes on this CPU, once the BSP has
+	// created the initial environments.
+	while (!boot_done)
+		asm volatile("pause");
 	sched_yield();
 
 	// Remove this after you finish Exercise 4
@@ -0,0 +1,255 @@
+// Object caches for the kernel's dynamically allocated data structures.
+//
+// Each cache hands out objects of one size.  Small objects are carved
+// out of one-page slabs; page-sized objects (such as page tables) are
+// whole pages from page_alloc.  In front of that, every CPU has a
+// magazine of free objects that it allocates from and frees to without
+// taking any lock; the cache lock is only taken to refill or empty a
+// magazine, half of it at a time.
+
+#include <inc/assert.h>
+#include <inc/string.h>
+#include <inc/error.h>
+
+#include <kern/kmem.h>
+#include <kern/pmap.h>
+#include <kern/cpu.h>
+
+static struct KmemCache kmem_caches[KMEM_NCACHES];
+static int kmem_ncaches;
+static struct spinlock kmem_caches_lock;
+
+void
+kmem_init(void)
+{
+	spin_initlock(&kmem_caches_lock);
+}
+
+//
+// Create a cache of objects of 'size' bytes, which must be at most
+// KMEM_SMALL_MAX or exactly PGSIZE.  Small objects are aligned to 8
+// bytes.  'name' is shown by the kmemstat monitor command.
+// Panics if there are too many caches.
+//
+struct KmemCache *
+kmem_cache_create(const char *name, size_t size, int flags)
+{
+	struct KmemCache *kc;
+
+	size = ROUNDUP(size, 8);
+	if (size > KMEM_SMALL_MAX && size != PGSIZE)
+		panic("kmem_cache_create %s: bad object size %d", name, size);
+
+	spin_lock(&kmem_caches_lock);
+	if (kmem_ncaches == KMEM_NCACHES)
+		panic("kmem_cache_create %s: too many caches", name);
+	kc = &kmem_caches[kmem_ncaches++];
+	spin_unlock(&kmem_caches_lock);
+
+	memset(kc, 0, sizeof(*kc));
+	kc->kc_name = name;
+	kc->kc_size = size;
+	kc->kc_flags = flags;
+	__spin_initlock(&kc->kc_lock, (char *) name);
+	return kc;
+}
+
+static struct Slab *
+slab_of(void *obj)
+{
+	return (struct Slab *) (ROUNDDOWN((char *) obj, PGSIZE) + PGSIZE) - 1;
+}
+
+static void
+slab_unlink(struct Slab **list, struct Slab *sl)
+{
+	if (sl->sl_prev)
+		sl->sl_prev->sl_next = sl->sl_next;
+	else
+		*list = sl->sl_next;
+	if (sl->sl_next)
+		sl->sl_next->sl_prev = sl->sl_prev;
+}
+
+static void
+slab_push(struct Slab **list, struct Slab *sl)
+{
+	sl->sl_prev = NULL;
+	sl->sl_next = *list;
+	if (*list)
+		(*list)->sl_prev = sl;
+	*list = sl;
+}
+
+// Get a page for a new slab and link all its objects into its free
+// list.  The caller holds kc's lock.
+static struct Slab *
+slab_create(struct KmemCache *kc)
+{
+	struct Page *pp;
+	struct Slab *sl;
+	char *obj;
+	size_t i, nobj = (PGSIZE - sizeof(struct Slab)) / kc->kc_size;
+
+	if (!(pp = page_alloc((kc->kc_flags & KMEM_ZEROED) ? ALLOC_ZERO : 0)))
+		return NULL;
+	obj = page2kva(pp);
+	sl = slab_of(obj);
+	sl->sl_inuse = 0;
+	sl->sl_free = NULL;
+	for (i = nobj; i-- > 0; ) {
+		*(void **) (obj + i * kc->kc_size) = sl->sl_free;
+		sl->sl_free = obj + i * kc->kc_size;
+	}
+	slab_push(&kc->kc_partial, sl);
+	kc->kc_nslabs++;
+	return sl;
+}
+
+// Take one object off kc's slabs or free pages, allocating a new page
+// if needed.  The caller holds kc's lock.
+static void *
+cache_take(struct KmemCache *kc)
+{
+	struct Page *pp;
+	struct Slab *sl;
+	void *obj;
+
+	if (kc->kc_size == PGSIZE) {
+		if ((pp = kc->kc_pages)) {
+			kc->kc_pages = pp->pp_link;
+			pp->pp_link = NULL;
+			kc->kc_npages--;
+		} else if ((pp = page_alloc((kc->kc_flags & KMEM_ZEROED) ? ALLOC_ZERO : 0)))
+			kc->kc_nslabs++;
+		else
+			return NULL;
+		kc->kc_out++;
+		return page2kva(pp);
+	}
+
+	if (!(sl = kc->kc_partial) && !(sl = slab_create(kc)))
+		return NULL;
+	obj = sl->sl_free;
+	sl->sl_free = *(void **) obj;
+	if (kc->kc_flags & KMEM_ZEROED)
+		*(void **) obj = NULL;
+	sl->sl_inuse++;
+	if (!sl->sl_free) {
+		slab_unlink(&kc->kc_partial, sl);
+		slab_push(&kc->kc_full, sl);
+	}
+	kc->kc_out++;
+	return obj;
+}
+
+// Return one object to kc's slabs or free pages, giving pages back to
+// the page allocator when the cache holds more than it needs.
+// The caller holds kc's lock.
+static void
+cache_put(struct KmemCache *kc, void *obj)
+{
+	struct Page *pp;
+	struct Slab *sl;
+
+	kc->kc_out--;
+	if (kc->kc_size == PGSIZE) {
+		pp = pa2page(PADDR(obj));
+		if (kc->kc_npages >= KMEM_MAG_SIZE) {
+			kc->kc_nslabs--;
+			page_free(pp);
+			return;
+		}
+		pp->pp_link = kc->kc_pages;
+		kc->kc_pages = pp;
+		kc->kc_npages++;
+		return;
+	}
+
+	sl = slab_of(obj);
+	if (!sl->sl_free) {
+		slab_unlink(&kc->kc_full, sl);
+		slab_push(&kc->kc_partial, sl);
+	}
+	*(void **) obj = sl->sl_free;
+	sl->sl_free = obj;
+	// Keep an empty slab only if it is the only slab with free objects.
+	if (--sl->sl_inuse == 0 && (sl->sl_prev || sl->sl_next)) {
+		slab_unlink(&kc->kc_partial, sl);
+		kc->kc_nslabs--;
+		page_free(pa2page(PADDR(ROUNDDOWN(obj, PGSIZE))));
+	}
+}
+
+//
+// Allocate an object from 'kc'.  If (alloc_flags & ALLOC_ZERO), the
+// object is zeroed.
+// Returns NULL if out of memory.
+//
+void *
+kmem_cache_alloc(struct KmemCache *kc, int alloc_flags)
+{
+	struct KmemMag *mag = &kc->kc_mag[cpunum()];
+	void *obj;
+
+	if (mag->km_count == 0) {
+		spin_lock(&kc->kc_lock);
+		while (mag->km_count < KMEM_MAG_SIZE / 2
+		       && (obj = cache_take(kc)))
+			mag->km_objs[mag->km_count++] = obj;
+		spin_unlock(&kc->kc_lock);
+		if (mag->km_count == 0)
+			return NULL;
+	}
+	obj = mag->km_objs[--mag->km_count];
+	mag->km_allocs++;
+	if ((alloc_flags & ALLOC_ZERO) && !(kc->kc_flags & KMEM_ZEROED))
+		memset(obj, 0, kc->kc_size);
+	return obj;
+}
+
+//
+// Return an object to 'kc'.  For a KMEM_ZEROED cache, the object must
+// be all zero.
+//
+void
+kmem_cache_free(struct KmemCache *kc, void *obj)
+{
+	struct KmemMag *mag = &kc->kc_mag[cpunum()];
+
+	if (mag->km_count == KMEM_MAG_SIZE) {
+		spin_lock(&kc->kc_lock);
+		while (mag->km_count > KMEM_MAG_SIZE / 2)
+			cache_put(kc, mag->km_objs[--mag->km_count]);
+		spin_unlock(&kc->kc_lock);
+	}
+	mag->km_objs[mag->km_count++] = obj;
+	mag->km_frees++;
+}
+
+//
+// Print each cache's object size, the objects in use and held in
+// magazines, the pages it holds, and its allocation and free counts.
+//
+void
+kmem_print_stats(void)
+{
+	struct KmemCache *kc;
+	uint32_t allocs, frees, inmags;
+	int i, j;
+
+	cprintf("%-12s %6s %8s %8s %8s %10s %10s\n", "CACHE", "SIZE",
+		"INUSE", "INMAGS", "PAGES", "ALLOCS", "FREES");
+	for (i = 0; i < kmem_ncaches; i++) {
+		kc = &kmem_caches[i];
+		allocs = frees = inmags = 0;
+		for (j = 0; j < NCPU; j++) {
+			allocs += kc->kc_mag[j].km_allocs;
+			frees += kc->kc_mag[j].km_frees;
+			inmags += kc->kc_mag[j].km_count;
+		}
+		cprintf("%-12s %6d %8u %8u %8u %10u %10u\n", kc->kc_name,
+			kc->kc_size, kc->kc_out - inmags, inmags,
+			kc->kc_nslabs, allocs, frees);
+	}
+}
@@ -0,0 +1,68 @@
+#ifndef JOS_KERN_KMEM_H
+#define JOS_KERN_KMEM_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <inc/mmu.h>
+#include <kern/cpu.h>
+#include <kern/spinlock.h>
+
+// Maximum number of object caches
+#define KMEM_NCACHES	16
+
+// Objects each CPU keeps for itself in a cache's magazine.
+#define KMEM_MAG_SIZE	16
+
+// Flags for kmem_cache_create
+enum {
+	// Free objects are all zero: the caller zeroes an object before
+	// freeing it, and ALLOC_ZERO costs nothing.
+	KMEM_ZEROED = 1<<0,
+};
+
+// One page of small objects; this header sits at the end of the page.
+struct Slab {
+	struct Slab *sl_next;
+	struct Slab *sl_prev;
+	void *sl_free;			// Free objects, linked through their
+					// first word
+	int sl_inuse;			// Objects not on sl_free
+};
+
+// Largest object size carved out of slabs.  Bigger objects must be
+// exactly a page.
+#define KMEM_SMALL_MAX	((PGSIZE - sizeof(struct Slab)) / 8)
+
+// A CPU's stack of free objects, used without locking.
+struct KmemMag {
+	int km_count;
+	void *km_objs[KMEM_MAG_SIZE];
+	uint32_t km_allocs;		// Objects this CPU allocated
+	uint32_t km_frees;		// ... and freed
+};
+
+// A cache of equally sized kernel objects.
+struct KmemCache {
+	const char *kc_name;
+	size_t kc_size;			// Object size, after alignment
+	int kc_flags;
+	struct spinlock kc_lock;	// Protects everything below but kc_mag
+	struct Slab *kc_partial;	// Slabs with free objects
+	struct Slab *kc_full;		// Slabs without
+	struct Page *kc_pages;		// Free page-sized objects
+	int kc_npages;			// ... and how many
+	uint32_t kc_nslabs;		// Pages held, as slabs or free objects
+	uint32_t kc_out;		// Objects out of the slabs, including
+					// those in magazines
+	struct KmemMag kc_mag[NCPU];
+};
+
+void	kmem_init(void);
+struct KmemCache *kmem_cache_create(const char *name, size_t size, int flags);
+void	*kmem_cache_alloc(struct KmemCache *kc, int alloc_flags);
+void	kmem_cache_free(struct KmemCache *kc, void *obj);
+void	kmem_print_stats(void);
+
+#endif /* !JOS_KERN_KMEM_H */
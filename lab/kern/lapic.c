@@ -44,6 +44,10 @@
 
 volatile uint32_t *lapic;  // Initialized in mp.c
 
+// Timer initial count, calibrated by time_init for TIMER_HZ interrupts
+// per second.  This default is only used until then.
+static uint32_t lapic_ticr = 10000000;
+
 static void
 lapicw(int index, int value)
 {
@@ -61,12 +65,11 @@ lapic_init(void)
 	lapicw(SVR, ENABLE | (IRQ_OFFSET + IRQ_SPURIOUS));
 
 	// The timer repeatedly counts down at bus frequency
-	// from lapic[TICR] and then issues an interrupt.  
-	// If we cared more about precise timekeeping,
-	// TICR would be calibrated using an external time source.
+	// from lapic[TICR] and then issues an interrupt.
+	// time_init calibrates TICR against the PIT.
 	lapicw(TDCR, X1);
 	lapicw(TIMER, PERIODIC | (IRQ_OFFSET + IRQ_TIMER));
-	lapicw(TICR, 10000000); 
+	lapicw(TICR, lapic_ticr);
 
 	// Leave LINT0 of the BSP enabled so that it can get
 	// interrupts from the 8259A chip.
@@ -168,6 +171,37 @@ lapic_startap(uint8_t apicid, uint32_t addr)
 	}
 }
 
+// Let this CPU's timer count down from ~0 without interrupting,
+// so time_init can measure the bus frequency with lapic_timer_count.
+void
+lapic_timer_calibrate(void)
+{
+	if (!lapic)
+		return;
+	lapicw(TDCR, X1);
+	lapicw(TIMER, MASKED | (IRQ_OFFSET + IRQ_TIMER));
+	lapicw(TICR, 0xffffffff);
+}
+
+uint32_t
+lapic_timer_count(void)
+{
+	return lapic ? lapic[TCCR] : 0;
+}
+
+// Make this CPU's timer interrupt every 'ticr' bus cycles, and have
+// every CPU started from now on do the same.
+void
+lapic_timer_start(uint32_t ticr)
+{
+	if (!lapic || !ticr)
+		return;
+	lapic_ticr = ticr;
+	lapicw(TDCR, X1);
+	lapicw(TIMER, PERIODIC | (IRQ_OFFSET + IRQ_TIMER));
+	lapicw(TICR, lapic_ticr);
+}
+
 void
 lapic_ipi(int vector)
 {
@@ -175,3 +209,13 @@ lapic_ipi(int vector)
 	while (lapic[ICRLO] & DELIVS)
 		;
 }
+
+// Send interrupt 'vector' to the CPU with local APIC ID 'apicid'.
+void
+lapic_ipi_cpu(uint8_t apicid, int vector)
+{
+	lapicw(ICRHI, apicid << 24);
+	lapicw(ICRLO, FIXED | vector);
+	while (lapic[ICRLO] & DELIVS)
+		;
+}
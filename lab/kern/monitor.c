@@ -14,6 +14,8 @@
 #include <kern/trap.h>
 #include <kern/env.h>
 #include <kern/sched.h>
+#include <kern/cpu.h>
+#include <kern/kmem.h>
 
 #define CMDBUF_SIZE	80	// enough for one VGA text line
 
@@ -49,6 +51,8 @@ static struct Command commands[] = {
 	{ "continue", "Continue execution after breakpoint exception", mon_continue},
 	{ "freepageinfo", "Display free page info", mon_freepageinfo},
 	{ "ps", "Display env info", mon_ps},
+	{ "schedstat", "Display scheduler statistics", mon_schedstat},
+	{ "kmemstat", "Display kernel object cache usage", mon_kmemstat},
 	{ "ss", "Single step execution", mon_singlestep}
 };
 #define NCOMMANDS (sizeof(commands)/sizeof(commands[0]))
@@ -433,6 +437,45 @@ mon_ps(int argc, char **argv, struct Trapframe *tf)
 	return 0;
 }	
 
+int 
+mon_schedstat(int argc, char **argv, struct Trapframe *tf)
+{
+	struct SchedStats *ss;
+	int i, j;
+
+	cprintf("%8s %4s %4s %8s %16s %16s %8s %8s\n", "ID", "CPU", "PRIO",
+		"RUNS", "RUN CYCLES", "WAIT CYCLES", "VOL", "INVOL");
+	for (i = 0; i < NENV; i++) {
+		if (envs[i].env_status)
+			cprintf("%08x %4d %4d %8u %16llu %16llu %8u %8u\n",
+				envs[i].env_id,
+				envs[i].env_cpunum,
+				envs[i].env_prio,
+				envs[i].env_runs,
+				envs[i].env_run_cycles,
+				envs[i].env_wait_cycles,
+				envs[i].env_vol_switches,
+				envs[i].env_invol_switches);
+	}
+	for (i = 0; i < ncpu; i++) {
+		ss = &cpus[i].cpu_stats;
+		cprintf("CPU %d: idle %llu cycles, %u IPC handoffs, run queue waits (log2 cycles: count):",
+			i, ss->ss_idle_cycles, ss->ss_handoffs);
+		for (j = 0; j < SCHED_HIST_BUCKETS; j++)
+			if (ss->ss_wait_hist[j])
+				cprintf(" %d:%u", j, ss->ss_wait_hist[j]);
+		cprintf("\n");
+	}
+	return 0;
+}	
+
+int 
+mon_kmemstat(int argc, char **argv, struct Trapframe *tf)
+{
+	kmem_print_stats();
+	return 0;
+}
+
 int mon_singlestep(int argc, char **argv, struct Trapframe *tf)
 {
 	if (tf != NULL)
@@ -444,8 +487,10 @@ int mon_singlestep(int argc, char **argv, struct Trapframe *tf)
 static void 
 dump_virtual_mem (pde_t *pgdir, uintptr_t start_addr, uintptr_t end_addr)
 {
-	if (pgdir != kern_pgdir)
-		lcr3(PADDR(pgdir));
+	pde_t *loaded = thiscpu->cpu_pgdir;
+
+	if (pgdir != loaded)
+		pgdir_load(pgdir);
 	cprintf("pgdir = %08x\n", pgdir);
 	uintptr_t addr;
 	for (addr = start_addr; addr <= end_addr; addr = (PDX(addr)+1) * PTSIZE) {
@@ -455,8 +500,8 @@ dump_virtual_mem (pde_t *pgdir, uintptr_t start_addr, uintptr_t end_addr)
 		dump_virtual_mem_per_pde(pgdir, addr, pde_end_addr < end_addr ? pde_end_addr : end_addr);
 	}
 	cprintf("\n");
-	if (pgdir != kern_pgdir)
-		lcr3(PADDR(curenv->env_pgdir));
+	if (pgdir != loaded)
+		pgdir_load(loaded);
 }
 
 static void 
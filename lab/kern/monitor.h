@@ -21,6 +21,8 @@ int mon_dump(int argc, char **argv, struct Trapframe *tf);
 int mon_continue(int argc, char **argv, struct Trapframe *tf);
 int mon_freepageinfo(int argc, char **argv, struct Trapframe *tf);
 int mon_ps(int argc, char **argv, struct Trapframe *tf);
+int mon_schedstat(int argc, char **argv, struct Trapframe *tf);
+int mon_kmemstat(int argc, char **argv, struct Trapframe *tf);
 int mon_singlestep(int argc, char **argv, struct Trapframe *tf);
 
 void get_pte_permission_desc(uint16_t pte_permission, char *msg);
@@ -11,6 +11,9 @@
 #include <kern/env.h>
 #include <kern/cpu.h>
 #include <kern/monitor.h>
+#include <kern/time.h>
+#include <kern/spinlock.h>
+#include <kern/kmem.h>
 
 // These variables are set by i386_detect_memory()
 size_t npages;			// Amount of physical memory (in pages)
@@ -19,9 +22,40 @@ static size_t npages_basemem;	// Amount of base memory (in pages)
 // These variables are set in mem_init()
 pde_t *kern_pgdir;		// Kernel's initial page directory
 struct Page *pages;		// Physical page state array
-static struct Page *page_free_list;	// Free list of physical pages
+
+// Buddy allocator: free physical memory is kept in naturally aligned
+// blocks of 2^order pages, with one free list per order.  Single pages
+// mostly come and go through the per-CPU caches (struct PageCache).
+static struct Page *page_free_area[PAGE_MAX_ORDER + 1];
+
+// A CPU's page cache is refilled from, and drained to, the buddy
+// allocator PCACHE_BATCH pages at a time, and holds at most PCACHE_HIGH.
+#define PCACHE_BATCH	16
+#define PCACHE_HIGH	64
+
+// Protects page_free_area and the pp_ref counts of pages that
+// may be shared between address spaces.
+static struct spinlock page_lock;
+
+// Pages zeroed ahead of time by idle CPUs (see page_prezero), which
+// page_alloc hands out first for ALLOC_ZERO.  Hits and misses count
+// ALLOC_ZERO requests that did and didn't find one.
+#define PZERO_MAX	128
+static struct Page *page_zero_pool;
+static int page_zero_count;
+static uint32_t page_zero_hits, page_zero_misses;
+static struct spinlock page_zero_lock;
+
+// Page tables come from their own object cache, which keeps them
+// zeroed: a page table is empty by the time it is freed.
+static struct KmemCache *pgtable_cache;
 
 static void set_used_pages(physaddr_t start_addr, physaddr_t end_addr); 
+static void buddy_free(struct Page *pp, int order);
+static struct Page *page_zero_pop(bool for_zero);
+static int page_cache_drain(void);
+static void tlb_batch_flush(struct TlbBatch *tb);
+static void page_decref_unmapped(struct Page *pp);
 
 // --------------------------------------------------------------
 // Detect machine's physical memory setup.
@@ -80,7 +114,7 @@ static void check_page_installed_pgdir(void);
 //
 // If we're out of memory, boot_alloc should panic.
 // This function may ONLY be used during initialization,
-// before the page_free_list list has been set up.
+// before the free lists have been set up.
 static void *
 boot_alloc(uint32_t n)
 {
@@ -166,6 +200,9 @@ mem_init(void)
 	// LAB 3: Your code here.
 	envs = (struct Env*) boot_alloc(sizeof(struct Env) * NENV);
 
+	// Give the clock a page of its own, to be mapped at UTIME.
+	timepage = (struct TimePage *) boot_alloc(PGSIZE);
+
 	//////////////////////////////////////////////////////////////////////
 	// Now that we've allocated the initial kernel data structures, we set
 	// up the list of free physical pages. Once we've done so, all further
@@ -173,6 +210,8 @@ mem_init(void)
 	// particular, we can now map memory using boot_map_region
 	// or page_insert
 	page_init();
+	kmem_init();
+	pgtable_cache = kmem_cache_create("pgtable", PGSIZE, KMEM_ZEROED);
 
 	check_page_free_list(1);
 	check_page_alloc();
@@ -194,7 +233,7 @@ mem_init(void)
 	physaddr_t phys_addr = PADDR(pages);
 	for (; upages_addr < upages_end_addr; upages_addr += PGSIZE,  phys_addr += PGSIZE) {
 		struct Page *page = pa2page(phys_addr);
-		page_insert(kern_pgdir, page, (void *)upages_addr, PTE_U);
+		page_insert(kern_pgdir, page, (void *)upages_addr, PTE_U | PTE_G);
 	}
 
 	//////////////////////////////////////////////////////////////////////
@@ -209,8 +248,12 @@ mem_init(void)
 	phys_addr = PADDR(envs);
 	for (; envs_addr < envs_end_addr; envs_addr += PGSIZE, phys_addr += PGSIZE) {
 		struct Page *page = pa2page(phys_addr);
-		page_insert(kern_pgdir, page, (void *)envs_addr, PTE_U);
+		page_insert(kern_pgdir, page, (void *)envs_addr, PTE_U | PTE_G);
 	}
+
+	// Map the clock read-only by the user at linear address UTIME.
+	static_assert(NENV * sizeof(struct Env) <= UTIME - UENVS);
+	page_insert(kern_pgdir, pa2page(PADDR(timepage)), (void *)UTIME, PTE_U | PTE_G);
 	
 
 	//////////////////////////////////////////////////////////////////////
@@ -231,7 +274,7 @@ mem_init(void)
 	for (i=0; kern_stack_addr < KSTACKTOP; i++, kern_stack_addr += PGSIZE) {
 		//cprintf("i = %d\n",i);
 		struct Page *page = pa2page(PADDR((void *)(bootstack + i * PGSIZE))); 
-		if (page_insert(kern_pgdir, page, (void *)kern_stack_addr, PTE_W) < 0){
+		if (page_insert(kern_pgdir, page, (void *)kern_stack_addr, PTE_W | PTE_G) < 0){
 			panic("page_insert error!");
 		}
 	}
@@ -243,22 +286,11 @@ mem_init(void)
 	// We might not have 2^32 - KERNBASE bytes of physical memory, but
 	// we just set up the mapping anyway.
 	// Permissions: kernel RW, user NONE
-	// Your code goes here:
-	//uintptr_t kern_addr = KERNBASE;
-	//phys_addr = 0;
-	//for (; kern_addr < IOMEMBASE && kern_addr >= KERNBASE; kern_addr += PGSIZE, phys_addr += PGSIZE) {
-		////cprintf("kern_addr = %8.8x\n",kern_addr);
-		//pte_t *ptep = pgdir_walk(kern_pgdir, (void *)kern_addr, 1);
-		//if (!ptep)
-			//panic("out of memory!");
-		//*ptep = phys_addr | PTE_W | PTE_P;
-	//}
-	uintptr_t kern_addr = KERNBASE;
-	phys_addr = 0;
-	for (; kern_addr < IOMEMBASE && kern_addr >= KERNBASE; kern_addr += PTSIZE, phys_addr += PTSIZE) {
-		pde_t *pdep = kern_pgdir + (kern_addr >> PTSHIFT);
-		*pdep = phys_addr | PTE_PS | PTE_W | PTE_P;
-	}
+	// Use 4MB superpages, so the whole range takes a few dozen TLB
+	// entries instead of one per 4KB page.
+	boot_map_region_large(kern_pgdir, KERNBASE, IOMEMBASE - KERNBASE, 0,
+			      PTE_W | PTE_G);
+
 	// Initialize the SMP-related parts of the memory map
 	mem_init_mp();
 
@@ -272,10 +304,12 @@ mem_init(void)
 	//
 	// If the machine reboots at this point, you've probably set up your
 	// kern_pgdir wrong.
-	uint32_t cr4 = rcr4();
-	cr4 |= (1<<4); //Open PSE
-	lcr4(cr4);
-	lcr3(PADDR(kern_pgdir));
+	//
+	// Mappings above UTOP, except UVPT, are the same in every address
+	// space and marked PTE_G: with CR4_PGE set, their TLB entries
+	// survive the CR3 reload on an env switch.
+	lcr4(rcr4() | CR4_PSE | CR4_PGE);
+	pgdir_load(kern_pgdir);
 
 	check_page_free_list(0);
 
@@ -300,7 +334,7 @@ mem_init_mp(void)
 {
 	// Create a direct mapping at the top of virtual address space starting
 	// at IOMEMBASE for accessing the LAPIC unit using memory-mapped I/O.
-	boot_map_region(kern_pgdir, IOMEMBASE, -IOMEMBASE, IOMEM_PADDR, PTE_W);
+	boot_map_region(kern_pgdir, IOMEMBASE, -IOMEMBASE, IOMEM_PADDR, PTE_W | PTE_G);
 
 	// Map per-CPU stacks starting at KSTACKTOP, for up to 'NCPU' CPUs.
 	//
@@ -328,7 +362,7 @@ mem_init_mp(void)
 			if (!pp)
 				panic("out of memory!");
 			if ((r = page_insert(kern_pgdir, pp, 
-					(void *)(base + j * PGSIZE), PTE_W) < 0)) 
+					(void *)(base + j * PGSIZE), PTE_W | PTE_G) < 0)) 
 				panic("mem_init_mp: %e", r);
 		}
 	}
@@ -344,10 +378,10 @@ mem_init_mp(void)
 // --------------------------------------------------------------
 
 //
-// Initialize page structure and memory free list.
+// Initialize page structure and memory free lists.
 // After this is done, NEVER use boot_alloc again.  ONLY use the page
 // allocator functions below to allocate and deallocate physical
-// memory via the page_free_list.
+// memory via the buddy allocator.
 //
 void
 page_init(void)
@@ -378,11 +412,11 @@ page_init(void)
 	// NB: DO NOT actually touch the physical memory corresponding to
 	// free pages!
 	size_t i;
-	for (i = 0; i < npages; i++) {
-		pages[i].pp_ref = 0;
-		pages[i].pp_link = page_free_list;
-		page_free_list = &pages[i];
-	}
+	spin_initlock(&page_lock);
+	spin_initlock(&page_zero_lock);
+	for (i = 0; i < NCPU; i++)
+		spin_initlock(&cpus[i].cpu_pcache.pc_lock);
+	memset(pages, 0, npages * sizeof(struct Page));
 	
 	//cprintf("page_init: start\n");
 	//page 0
@@ -402,29 +436,19 @@ page_init(void)
 	set_used_pages(IOPHYSMEM, EXTPHYSMEM);
 	//cprintf("page_init: IO hole OK\n");
 	
-	//TODO: the kernel -- how much memory use for kernel(code, data, stack)?
-	//kernel code memory
-	start_addr = 0x100000;
-    end_addr = (unsigned int)(ROUNDUP((char *) end, PGSIZE) - KERNBASE);
-	set_used_pages(start_addr, end_addr);
-	
-	//page dir
-	start_addr = PADDR((void *)kern_pgdir);
-	end_addr = start_addr + PGSIZE;
-	set_used_pages(start_addr, end_addr);
-	
-	//struct Pages
-	start_addr = PADDR((void *)pages);
-	end_addr = start_addr + npages * sizeof(struct Page);
-	set_used_pages(start_addr, end_addr);
-	
-	//struct envs
-	start_addr = PADDR((void *)envs);
-	end_addr = start_addr + NENV * sizeof(struct Env);
+	//the kernel (code, data, stack), and everything boot_alloc
+	//gave out after it: kern_pgdir, pages, envs, the clock page
+	start_addr = EXTPHYSMEM;
+	end_addr = PADDR(boot_alloc(0));
 	set_used_pages(start_addr, end_addr);
 	
+	//Free the rest.  Going downwards leaves the lowest block of each
+	//order at the head of its list, so the pages handed out while
+	//entry_pgdir is still loaded come from the low 4MB it maps.
+	for (i = npages; i-- > 0; )
+		if (pages[i].pp_ref == 0)
+			buddy_free(&pages[i], 0);
 	
-	//cprintf("first free page pa = %uK\n", page2pa(page_free_list)/1024);
 	//cprintf("page_init: struct Pages OK\n");
 	//print_freepageinfo();
 }
@@ -435,12 +459,74 @@ static void
 set_used_pages(physaddr_t start_addr, physaddr_t end_addr) 
 {
 	int i = start_addr / PGSIZE;
-	struct Page * saved_page_free_list = pages[i].pp_link;
-	for (; start_addr < end_addr; start_addr += PGSIZE, i++) {
+	for (; start_addr < end_addr; start_addr += PGSIZE, i++)
 		pages[i].pp_ref = 1;
-		pages[i].pp_link = 0;
+}
+
+//
+// Buddy allocator internals; the caller holds page_lock.
+//
+
+static void
+buddy_unlink(struct Page *pp)
+{
+	if (pp->pp_prev)
+		pp->pp_prev->pp_link = pp->pp_link;
+	else
+		page_free_area[pp->pp_order] = pp->pp_link;
+	if (pp->pp_link)
+		pp->pp_link->pp_prev = pp->pp_prev;
+	pp->pp_link = pp->pp_prev = NULL;
+	pp->pp_order = pp->pp_free = 0;
+}
+
+static void
+buddy_push(struct Page *pp, int order)
+{
+	pp->pp_order = order;
+	pp->pp_free = 1;
+	pp->pp_prev = NULL;
+	pp->pp_link = page_free_area[order];
+	if (pp->pp_link)
+		pp->pp_link->pp_prev = pp;
+	page_free_area[order] = pp;
+}
+
+// Put the block of 2^order pages at pp on the free lists, merging it
+// with its buddy for as long as the buddy is free too.
+static void
+buddy_free(struct Page *pp, int order)
+{
+	size_t pn = pp - pages, bn;
+
+	for (; order < PAGE_MAX_ORDER; order++) {
+		bn = pn ^ (1 << order);
+		if (bn + (1 << order) > npages || !pages[bn].pp_free
+		    || pages[bn].pp_order != order)
+			break;
+		buddy_unlink(&pages[bn]);
+		pn &= ~(1 << order);
 	}
-	pages[i].pp_link = saved_page_free_list;
+	buddy_push(&pages[pn], order);
+}
+
+// Take a block of 2^order pages off the free lists, splitting the
+// smallest larger block if there is none of that order.
+static struct Page *
+buddy_alloc(int order)
+{
+	struct Page *pp;
+	int o;
+
+	for (o = order; o <= PAGE_MAX_ORDER && !page_free_area[o]; o++)
+		;
+	if (o > PAGE_MAX_ORDER)
+		return NULL;
+	pp = page_free_area[o];
+	buddy_unlink(pp);
+	while (o-- > order)
+		buddy_push(pp + (1 << o), o);
+	return pp;
 }
 
 //
@@ -452,25 +538,131 @@ set_used_pages(physaddr_t start_addr, physaddr_t end_addr)
 // Returns NULL if out of free memory.
 //
 // Hint: use page2kva and memset
+//
+// Single pages come from this CPU's page cache, which is refilled from
+// the buddy allocator when it runs dry.  ALLOC_ZERO requests take a
+// pre-zeroed page if there is one, and the pre-zeroed pages are the
+// next resort for any request.  Only then are the pages in other CPUs'
+// caches taken back.
 struct Page *
 page_alloc(int alloc_flags)
 {
-	// Fill this function in
-	if (page_free_list == 0) {
-		//cprintf("WARN: out of memory!\n");
-		return NULL;
+	struct PageCache *pc = &thiscpu->cpu_pcache;
+	struct Page *pp;
+	bool drained = 0;
+
+	if ((alloc_flags & ALLOC_ZERO) && (pp = page_zero_pop(1)))
+		return pp;
+
+	spin_lock(&pc->pc_lock);
+	while (!pc->pc_head) {
+		spin_lock(&page_lock);
+		while (pc->pc_count < PCACHE_BATCH && (pp = buddy_alloc(0))) {
+			pp->pp_link = pc->pc_head;
+			pc->pc_head = pp;
+			pc->pc_count++;
+		}
+		spin_unlock(&page_lock);
+		if (pc->pc_head)
+			break;
+		spin_unlock(&pc->pc_lock);
+		if ((pp = page_zero_pop(0)) || drained || !page_cache_drain()) {
+			//cprintf("WARN: out of memory!\n");
+			return pp;
+		}
+		drained = 1;
+		spin_lock(&pc->pc_lock);
 	}
 	
-	//cprintf("page_alloc: allloc pa %uK\n",page2pa(page_free_list)/1024);
-	
-	// Change page_free_list because of alloc
-	struct Page *alloc_page = page_free_list;
-	page_free_list = alloc_page->pp_link;
+	pp = pc->pc_head;
+	pc->pc_head = pp->pp_link;
+	pc->pc_count--;
+	spin_unlock(&pc->pc_lock);
+	pp->pp_link = NULL;
 	
 	// Set the page with '\0'
 	if (alloc_flags & ALLOC_ZERO)
-		memset (page2kva(alloc_page), 0, PGSIZE);
-	return alloc_page;
+		memset(page2kva(pp), 0, PGSIZE);
+	return pp;
+}
+
+//
+// Give the pages in every CPU's page cache back to the buddy
+// allocator, which has run dry.  Returns the number of pages given
+// back.  The caller holds no page cache lock.
+//
+static int
+page_cache_drain(void)
+{
+	struct PageCache *pc;
+	struct Page *pp;
+	int i, n = 0;
+
+	for (i = 0; i < ncpu; i++) {
+		pc = &cpus[i].cpu_pcache;
+		spin_lock(&pc->pc_lock);
+		spin_lock(&page_lock);
+		while ((pp = pc->pc_head)) {
+			pc->pc_head = pp->pp_link;
+			buddy_free(pp, 0);
+			n++;
+		}
+		pc->pc_count = 0;
+		spin_unlock(&page_lock);
+		spin_unlock(&pc->pc_lock);
+	}
+	return n;
+}
+
+//
+// Take a page off the pool of pre-zeroed pages, or return NULL if it
+// is empty.  If 'for_zero', count the request as a hit or a miss.
+//
+static struct Page *
+page_zero_pop(bool for_zero)
+{
+	struct Page *pp;
+
+	spin_lock(&page_zero_lock);
+	if ((pp = page_zero_pool)) {
+		page_zero_pool = pp->pp_link;
+		page_zero_count--;
+		pp->pp_link = NULL;
+	}
+	if (for_zero) {
+		if (pp)
+			page_zero_hits++;
+		else
+			page_zero_misses++;
+	}
+	spin_unlock(&page_zero_lock);
+	return pp;
+}
+
+//
+// Zero one free page and add it to the pool of pre-zeroed pages.
+// Called by CPUs that have nothing better to do.
+// Returns 0 if the pool is already full or there is no free page.
+//
+int
+page_prezero(void)
+{
+	struct Page *pp;
+
+	if (page_zero_count >= PZERO_MAX || !(pp = page_alloc(0)))
+		return 0;
+	memset(page2kva(pp), 0, PGSIZE);
+	spin_lock(&page_zero_lock);
+	if (page_zero_count >= PZERO_MAX) {
+		spin_unlock(&page_zero_lock);
+		page_free(pp);
+		return 0;
+	}
+	pp->pp_link = page_zero_pool;
+	page_zero_pool = pp;
+	page_zero_count++;
+	spin_unlock(&page_zero_lock);
+	return 1;
 }
 
 //
@@ -480,8 +672,72 @@ page_alloc(int alloc_flags)
 void
 page_free(struct Page *pp)
 {
-	pp->pp_link = page_free_list;
-	page_free_list = pp;
+	struct PageCache *pc = &thiscpu->cpu_pcache;
+
+	spin_lock(&pc->pc_lock);
+	pp->pp_link = pc->pc_head;
+	pc->pc_head = pp;
+	if (++pc->pc_count <= PCACHE_HIGH) {
+		spin_unlock(&pc->pc_lock);
+		return;
+	}
+
+	spin_lock(&page_lock);
+	while (pc->pc_count > PCACHE_HIGH - PCACHE_BATCH) {
+		pp = pc->pc_head;
+		pc->pc_head = pp->pp_link;
+		pc->pc_count--;
+		buddy_free(pp, 0);
+	}
+	spin_unlock(&page_lock);
+	spin_unlock(&pc->pc_lock);
+}
+
+//
+// Allocate 2^order physically contiguous pages, aligned to their size,
+// for DMA rings, superpages and the like.  Flags are as for page_alloc.
+// Does NOT increment any reference count; the caller keeps the block's
+// count in the first page's pp_ref, if it needs one.
+//
+// Returns NULL if there is no free block that large.
+//
+struct Page *
+page_alloc_order(int order, int alloc_flags)
+{
+	struct Page *pp;
+
+	if (order == 0)
+		return page_alloc(alloc_flags);
+	if (order > PAGE_MAX_ORDER)
+		return NULL;
+	spin_lock(&page_lock);
+	pp = buddy_alloc(order);
+	spin_unlock(&page_lock);
+	// Pages in the CPUs' caches may be keeping their buddies from
+	// merging into a big enough block.
+	if (!pp && page_cache_drain()) {
+		spin_lock(&page_lock);
+		pp = buddy_alloc(order);
+		spin_unlock(&page_lock);
+	}
+	if (pp && (alloc_flags & ALLOC_ZERO))
+		memset(page2kva(pp), 0, PGSIZE << order);
+	return pp;
+}
+
+//
+// Return a block from page_alloc_order.
+//
+void
+page_free_order(struct Page *pp, int order)
+{
+	if (order == 0) {
+		page_free(pp);
+		return;
+	}
+	spin_lock(&page_lock);
+	buddy_free(pp, order);
+	spin_unlock(&page_lock);
 }
 
 //
@@ -491,7 +747,12 @@ page_free(struct Page *pp)
 void
 page_decref(struct Page* pp)
 {
-	if (--pp->pp_ref == 0)
+	int ref;
+
+	spin_lock(&page_lock);
+	ref = --pp->pp_ref;
+	spin_unlock(&page_lock);
+	if (ref == 0)
 		page_free(pp);
 }
 
@@ -507,6 +768,10 @@ page_decref(struct Page* pp)
 //	the page is cleared,
 //	and pgdir_walk returns a pointer into the new page table page.
 //
+// If 'va' is mapped by a 4MB superpage, there is no page table: the
+// page directory entry itself, with PTE_PS set, maps 'va', and
+// pgdir_walk returns a pointer to it.
+//
 // Hint 1: you can turn a Page * into the physical address of the
 // page it refers to with page2pa() from kern/pmap.h.
 //
@@ -522,11 +787,14 @@ pgdir_walk(pde_t *pgdir, const void *va, int create)
 {
 	// Fill this function in
 	pde_t pde = pgdir[PDX(va)];
+	if ((pde & (PTE_P | PTE_PS)) == (PTE_P | PTE_PS))
+		return &pgdir[PDX(va)];
 	if (!(pde & PTE_P)) { //page table doesn't exist
 		if (create) {
-			struct Page *new_page = page_alloc(ALLOC_ZERO); //used as page table page
-			if (!new_page) 
+			void *pt = kmem_cache_alloc(pgtable_cache, ALLOC_ZERO);
+			if (!pt) 
 				return NULL;
+			struct Page *new_page = pa2page(PADDR(pt)); //used as page table page
 			new_page->pp_ref++;
 			//if ((uint32_t)(pgdir+PDX(va)) > 0xf0400000)
 			//	panic("havn't mapped\n");
@@ -542,6 +810,195 @@ pgdir_walk(pde_t *pgdir, const void *va, int create)
 	return page_table + PTX(va);
 }
 
+//
+// Page tables below UTOP may be shared between the address spaces of
+// a forked env and its parent (see pgdir_fork).  A shared page table
+// is mapped through a read-only page directory entry marked PTE_COW,
+// and its Page's pp_ref counts the page directories that use it; the
+// pages it maps count it once, however many address spaces share it.
+// Before changing an entry in a shared page table, an address space
+// takes a private copy with pgtable_unshare.
+//
+
+//
+// Give 'pgdir' a private copy of the page table covering 'va', if that
+// table is shared.  The copy, and the shared table itself, then map
+// writable and copy-on-write pages copy-on-write, since both map them.
+// If no other address space shares the table any more, it is simply
+// made writable again.  The caller must hold the lock of the env that
+// owns 'pgdir'.
+//
+// RETURNS:
+//   0 on success
+//   -E_NO_MEM, if the copy couldn't be allocated
+//
+int
+pgtable_unshare(pde_t *pgdir, void *va)
+{
+	pde_t *pdep = &pgdir[PDX(va)];
+	struct Page *ptp, *copy = NULL;
+	pte_t *pt, *cpt = NULL;
+	uint32_t i;
+
+	if ((uintptr_t) va >= UTOP
+	    || (*pdep & (PTE_P | PTE_PS | PTE_COW)) != (PTE_P | PTE_COW))
+		return 0;
+	ptp = pa2page(PTE_ADDR(*pdep));
+	if (ptp->pp_ref > 1) {
+		if (!(cpt = kmem_cache_alloc(pgtable_cache, 0)))
+			return -E_NO_MEM;
+		copy = pa2page(PADDR(cpt));
+	}
+
+	// The other sharers may be unsharing the same table meanwhile.
+	spin_lock(&page_lock);
+	if (ptp->pp_ref == 1) {
+		spin_unlock(&page_lock);
+		if (copy)
+			kmem_cache_free(pgtable_cache, page2kva(copy));
+		*pdep = (*pdep & ~PTE_COW) | PTE_W;
+	} else {
+		pt = page2kva(ptp);
+		for (i = 0; i < NPTENTRIES; i++) {
+			if (pt[i] & PTE_P) {
+				if (!(pt[i] & PTE_SHARE) && (pt[i] & (PTE_W | PTE_COW)))
+					pt[i] = (pt[i] & ~PTE_W) | PTE_COW;
+				pa2page(PTE_ADDR(pt[i]))->pp_ref++;
+			}
+			cpt[i] = pt[i];
+		}
+		ptp->pp_ref--;
+		copy->pp_ref = 1;
+		spin_unlock(&page_lock);
+		*pdep = page2pa(copy) | PTE_P | PTE_U | PTE_W;
+	}
+	tlb_flush(pgdir);
+	return 0;
+}
+
+//
+// Drop a reference to page table page 'pp', returning it to the page
+// table cache if that was the last one.  The table must be empty.
+//
+void
+pgtable_decref(struct Page *pp)
+{
+	int ref;
+
+	spin_lock(&page_lock);
+	ref = --pp->pp_ref;
+	spin_unlock(&page_lock);
+	if (ref == 0)
+		kmem_cache_free(pgtable_cache, page2kva(pp));
+}
+
+//
+// Called when the address space 'pgdir' is being freed.  If its page
+// table number 'pdeno' is shared with other address spaces, drop this
+// address space's use of it and return 1.  Otherwise return 0: the
+// table is the caller's alone, to empty and free as usual.
+//
+int
+pgtable_release(pde_t *pgdir, uint32_t pdeno)
+{
+	struct Page *ptp;
+
+	if ((pgdir[pdeno] & (PTE_P | PTE_PS | PTE_COW)) != (PTE_P | PTE_COW))
+		return 0;
+	ptp = pa2page(PTE_ADDR(pgdir[pdeno]));
+	spin_lock(&page_lock);
+	if (ptp->pp_ref > 1) {
+		ptp->pp_ref--;
+		spin_unlock(&page_lock);
+		pgdir[pdeno] = 0;
+		return 1;
+	}
+	spin_unlock(&page_lock);
+	pgdir[pdeno] = (pgdir[pdeno] & ~PTE_COW) | PTE_W;
+	return 0;
+}
+
+//
+// Copy the user part of address space 'src' into the empty address
+// space 'dst', for fork.  Whole page tables are shared between the two
+// (see pgtable_unshare), so this costs one step per page table, not
+// per page.  The exception is the page table holding the user exception
+// stack, which is copied entry by entry: pages marked PTE_SHARE are
+// mapped as they are; writable and copy-on-write pages become
+// copy-on-write (and read-only) in both; other pages are mapped
+// read-only.  The exception stack itself is not shared: 'dst' gets a
+// fresh page there.  Writable superpages become copy-on-write too,
+// and are copied whole on the first write (see page_cow); superpages
+// marked PTE_SHARE are shared as they are.
+//
+// The caller must hold both envs' locks, and must then flush the TLB
+// entries of 'src' with tlb_flush, even if this fails.
+//
+// RETURNS:
+//   0 on success
+//   -E_NO_MEM, if a page table or page couldn't be allocated
+//
+int
+pgdir_fork(pde_t *dst, pde_t *src)
+{
+	uint32_t pdeno, pteno;
+	pte_t *spt, *dpt, pte;
+	struct Page *pp;
+	void *va;
+
+	for (pdeno = 0; pdeno < PDX(UTOP); pdeno++) {
+		if (!(src[pdeno] & PTE_P) || pdeno == PDX(UXSTACKTOP - PGSIZE))
+			continue;
+		// Page tables are shared read-only; a writable superpage
+		// is copied on write, unless it is PTE_SHARE.
+		if (!(src[pdeno] & PTE_PS)
+		    || (src[pdeno] & (PTE_W | PTE_SHARE)) == PTE_W)
+			src[pdeno] = (src[pdeno] & ~PTE_W) | PTE_COW;
+		dst[pdeno] = src[pdeno];
+		pp = pa2page(PTE_ADDR(src[pdeno]));
+		spin_lock(&page_lock);
+		pp->pp_ref++;
+		spin_unlock(&page_lock);
+	}
+
+	pdeno = PDX(UXSTACKTOP - PGSIZE);
+	if (src[pdeno] & PTE_P) {
+		if (pgtable_unshare(src, PGADDR(pdeno, 0, 0)) < 0)
+			return -E_NO_MEM;
+		spt = (pte_t *) KADDR(PTE_ADDR(src[pdeno]));
+		dpt = NULL;
+		for (pteno = 0; pteno < NPTENTRIES; pteno++) {
+			pte = spt[pteno];
+			va = PGADDR(pdeno, pteno, 0);
+			if (!(pte & PTE_P) || va == (void *) (UXSTACKTOP - PGSIZE))
+				continue;
+			if (!dpt) {
+				if (!(dpt = pgdir_walk(dst, va, 1)))
+					return -E_NO_MEM;
+				dpt -= pteno;
+			}
+			if (!(pte & PTE_SHARE) && (pte & (PTE_W | PTE_COW)))
+				spt[pteno] = pte = (pte & ~PTE_W) | PTE_COW;
+			pp = pa2page(PTE_ADDR(pte));
+			spin_lock(&page_lock);
+			pp->pp_ref++;
+			spin_unlock(&page_lock);
+			dpt[pteno] = pte & ~(PTE_A | PTE_D);
+		}
+	}
+
+	if (page_lookup(src, (void *) (UXSTACKTOP - PGSIZE), NULL)) {
+		if (!(pp = page_alloc(ALLOC_ZERO)))
+			return -E_NO_MEM;
+		if (page_insert(dst, pp, (void *) (UXSTACKTOP - PGSIZE),
+				PTE_U | PTE_W) < 0) {
+			page_free(pp);
+			return -E_NO_MEM;
+		}
+	}
+	return 0;
+}
+
 //
 // Map [va, va+size) of virtual address space to physical [pa, pa+size)
 // in the page table rooted at pgdir.  Size is a multiple of PGSIZE.
@@ -570,6 +1027,24 @@ boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm
 	}
 }
 
+//
+// Like boot_map_region, but maps the region with 4MB superpages: each
+// page directory entry maps PTSIZE bytes itself, with PTE_PS set, and
+// no page table is needed.  'va', 'size' and 'pa' must be multiples
+// of PTSIZE.  The mapping takes effect once CR4_PSE is set.
+//
+void
+boot_map_region_large(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm)
+{
+	size_t i;
+
+	assert(size > 0);
+	assert(va % PTSIZE == 0 && size % PTSIZE == 0 && pa % PTSIZE == 0);
+
+	for (i = 0; i < size / PTSIZE; i++)
+		pgdir[PDX(va + i * PTSIZE)] = (pa + i * PTSIZE) | perm | PTE_PS | PTE_P;
+}
+
 //
 // Map the physical page 'pp' at virtual address 'va'.
 // The permissions (the low 12 bits) of the page table entry
@@ -587,6 +1062,8 @@ boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm
 // Don't be tempted to write special-case code to handle this
 // situation, though; there's an elegant way to address it.
 //
+// A superpage covering 'va' is removed as a whole.
+//
 // RETURNS:
 //   0 on success
 //   -E_NO_MEM, if page table couldn't be allocated
@@ -597,10 +1074,15 @@ boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm
 int
 page_insert(pde_t *pgdir, struct Page *pp, void *va, int perm)
 {
+	if (pgtable_unshare(pgdir, va) < 0)
+		return -E_NO_MEM;
+	if ((pgdir[PDX(va)] & (PTE_P | PTE_PS)) == (PTE_P | PTE_PS))
+		page_remove(pgdir, va);
 	pte_t *ptep = pgdir_walk(pgdir, va, 0);
 	if (ptep && (*ptep & PTE_P)) {
 		if (PTE_ADDR(*ptep) == page2pa(pp) ) {
 			*ptep = page2pa(pp) | perm | PTE_P;
+			tlb_invalidate(pgdir, va);
 			return 0;
 		}
 		page_remove(pgdir, va);
@@ -613,7 +1095,9 @@ page_insert(pde_t *pgdir, struct Page *pp, void *va, int perm)
 			return -E_NO_MEM;
 		}
 	}
+	spin_lock(&page_lock);
 	pp->pp_ref++;
+	spin_unlock(&page_lock);
 	
 	*ptep = page2pa(pp) | perm | PTE_P;
 	//cprintf("here4\n");
@@ -628,6 +1112,8 @@ page_insert(pde_t *pgdir, struct Page *pp, void *va, int perm)
 // but should not be used by most callers.
 //
 // Return NULL if there is no page mapped at va.
+// If va is in a superpage, the page returned is the 4KB page of the
+// superpage at va, and the pte stored is the page directory entry.
 //
 // Hint: the TA solution uses pgdir_walk and pa2page.
 //
@@ -643,6 +1129,8 @@ page_lookup(pde_t *pgdir, void *va, pte_t **pte_store)
 	//s=extern size_t npages; 
 	//cprintf("PTE_ADDR(*ptep) = %8.8x, npages = %d, pgnum = %d, b = %d\n",
 	//PTE_ADDR(*ptep), npages, PGNUM(PTE_ADDR(*ptep)), PGNUM(PTE_ADDR(*ptep)) >= npages);
+	if (*ptep & PTE_PS)
+		return pa2page(PTE_ADDR(*ptep)) + PTX(va);
 	return pa2page(PTE_ADDR(*ptep));
 }
 
@@ -658,40 +1146,375 @@ page_lookup(pde_t *pgdir, void *va, pte_t **pte_store)
 //   - The TLB must be invalidated if you remove an entry from
 //     the page table.
 //
+// If 'va' is in a superpage, the whole superpage is unmapped, and its
+// 4MB block freed when its last mapping goes.  If 'va' is in a shared
+// page table, 'pgdir' first gets a private copy of it (see
+// pgtable_unshare).
+//
+// RETURNS:
+//   0 on success
+//   -E_NO_MEM, if a shared page table couldn't be copied; nothing
+//     is unmapped then
+//
 // Hint: The TA solution is implemented using page_lookup,
 // 	tlb_invalidate, and page_decref.
 //
-void
+int
 page_remove(pde_t *pgdir, void *va)
 {
 	// Fill this function in
 	pte_t *ptep = pgdir_walk(pgdir, va, 0);
+	struct Page *pp;
+	int ref;
 	
 	if (ptep == NULL)
-		return;
+		return 0;
 		
 	if (!(*ptep & PTE_P))
-		return;
+		return 0;
+	if (*ptep & PTE_PS) {
+		pp = pa2page(PTE_ADDR(*ptep));
+		*ptep = 0;
+		tlb_invalidate(pgdir, va);
+		spin_lock(&page_lock);
+		ref = --pp->pp_ref;
+		spin_unlock(&page_lock);
+		if (ref == 0) {
+			// Too big to hold for a batched shootdown: send it now.
+			tlb_batch_flush(&thiscpu->cpu_tlb);
+			page_free_order(pp, PAGE_MAX_ORDER);
+		}
+		return 0;
+	}
+	if (pgtable_unshare(pgdir, va) < 0)
+		return -E_NO_MEM;
+	ptep = pgdir_walk(pgdir, va, 0);
 	//cprintf("page_remove: here1\n");	
 	//cprintf("pa = %8.8x\n",PTE_ADDR(*ptep));
 	struct Page *page = pa2page(PTE_ADDR(*ptep));
 	//cprintf("page_remove: here2\n");	
-	page_decref(page);
-
-	tlb_invalidate(pgdir,va);
 	*ptep = 0;
+	tlb_invalidate(pgdir,va);
+	page_decref_unmapped(page);
+	return 0;
+}
+
+//
+// page_cow for a copy-on-write superpage: copy all 4MB of it.
+//
+static int
+superpage_cow(pde_t *pgdir, void *va)
+{
+	pde_t *pdep = &pgdir[PDX(va)];
+	struct Page *pp, *copy;
+	int perm;
+
+	if (!(*pdep & PTE_COW))
+		return -E_INVAL;
+	va = ROUNDDOWN(va, PTSIZE);
+	pp = pa2page(PTE_ADDR(*pdep));
+	perm = ((*pdep & PTE_SYSCALL) & ~PTE_COW) | PTE_W;
+	if (pp->pp_ref == 1) {
+		*pdep = page2pa(pp) | perm | PTE_PS | PTE_P;
+		tlb_invalidate(pgdir, va);
+		return 0;
+	}
+	if (!(copy = page_alloc_order(PAGE_MAX_ORDER, 0)))
+		return -E_NO_MEM;
+	memmove(page2kva(copy), page2kva(pp), PTSIZE);
+	// Replaces the shared superpage, so this can't fail.
+	return superpage_insert(pgdir, copy, va, perm);
+}
+
+//
+// Give 'pgdir' a private, writable copy of the copy-on-write page
+// mapped at 'va', after a write fault there.  If no one else maps the
+// page any more, it is simply made writable again.  A shared page
+// table covering 'va' is unshared first.  A copy-on-write superpage
+// is copied whole.  The caller must hold the lock of the env that
+// owns 'pgdir'.
+//
+// RETURNS:
+//   0 on success
+//   -E_INVAL, if 'va' is neither mapped copy-on-write nor covered by
+//	a shared page table
+//   -E_NO_MEM, if a copy couldn't be allocated
+//
+int
+page_cow(pde_t *pgdir, void *va)
+{
+	pte_t *ptep;
+	struct Page *pp, *copy;
+	int perm, shared, r;
+
+	if ((pgdir[PDX(va)] & (PTE_P | PTE_PS)) == (PTE_P | PTE_PS))
+		return superpage_cow(pgdir, va);
+	va = ROUNDDOWN(va, PGSIZE);
+	shared = (pgdir[PDX(va)] & (PTE_P | PTE_COW)) == (PTE_P | PTE_COW);
+	if (shared && (r = pgtable_unshare(pgdir, va)) < 0)
+		return r;
+	if (!(pp = page_lookup(pgdir, va, &ptep)) || !(*ptep & PTE_COW))
+		return shared ? 0 : -E_INVAL;
+	// Other mappings of pp can only be added through pgdir,
+	// whose owner's lock we hold.
+	if (pp->pp_ref == 1) {
+		*ptep = (*ptep & ~PTE_COW) | PTE_W;
+		tlb_invalidate(pgdir, va);
+		return 0;
+	}
+	if (!(copy = page_alloc(0)))
+		return -E_NO_MEM;
+	memmove(page2kva(copy), page2kva(pp), PGSIZE);
+	perm = ((*ptep & PTE_SYSCALL) & ~PTE_COW) | PTE_W;
+	// Replaces the old mapping; the page table exists, so this can't fail.
+	page_insert(pgdir, copy, va, perm);
+	return 0;
+}
+
+//
+// Map the 4MB block 'pp', from page_alloc_order(PAGE_MAX_ORDER, ...),
+// as a superpage at the PTSIZE-aligned address 'va' below UTOP, with
+// permissions 'perm|PTE_PS|PTE_P'.  The block's reference count is
+// kept in pp->pp_ref.  A superpage replaces a whole page table, so
+// no 4KB page may be mapped in [va, va+PTSIZE); an empty page table
+// there is freed, and a superpage there is replaced.  The caller must
+// hold the lock of the env that owns 'pgdir'.
+//
+// RETURNS:
+//   0 on success
+//   -E_INVAL, if 4KB pages are mapped in [va, va+PTSIZE)
+//
+int
+superpage_insert(pde_t *pgdir, struct Page *pp, void *va, int perm)
+{
+	pde_t *pdep = &pgdir[PDX(va)];
+	pte_t *pt;
+	uint32_t pteno;
+
+	assert((uintptr_t) va < UTOP && (uintptr_t) va % PTSIZE == 0);
+	if ((*pdep & (PTE_P | PTE_PS)) == (PTE_P | PTE_PS)) {
+		if (PTE_ADDR(*pdep) == page2pa(pp)) {
+			*pdep = page2pa(pp) | perm | PTE_PS | PTE_P;
+			tlb_invalidate(pgdir, va);
+			return 0;
+		}
+		page_remove(pgdir, va);
+	} else if (*pdep & PTE_P) {
+		pt = (pte_t *) KADDR(PTE_ADDR(*pdep));
+		for (pteno = 0; pteno < NPTENTRIES; pteno++)
+			if (pt[pteno] & PTE_P)
+				return -E_INVAL;
+		if (!pgtable_release(pgdir, PDX(va))) {
+			pgtable_decref(pa2page(PTE_ADDR(*pdep)));
+			*pdep = 0;
+		}
+	}
+
+	spin_lock(&page_lock);
+	pp->pp_ref++;
+	spin_unlock(&page_lock);
+	*pdep = page2pa(pp) | perm | PTE_PS | PTE_P;
+	// Drop any cached walk through the old page table.
+	tlb_invalidate(pgdir, va);
+	return 0;
+}
+
+// --------------------------------------------------------------
+// TLB shootdown.
+//
+// Every CPU records the page directory it has loaded in cpu_pgdir
+// (see pgdir_load).  When an address space changes, the TLB entries
+// of the other CPUs that have it loaded are invalidated with an
+// IRQ_TLB IPI, and the change waits until they have done so.  One
+// shootdown at a time is in flight, described by tlb_req.
+// --------------------------------------------------------------
+
+static struct {
+	volatile uint32_t busy;		// A CPU is sending tlb_req
+	pde_t *pgdir;
+	int count;			// As for tb_count
+	uintptr_t va[TLB_BATCH_MAX];
+} tlb_req;
+
+//
+// Load 'pgdir' into this CPU's CR3, recording it for TLB shootdowns.
+// Use this rather than lcr3 to switch address spaces.
+//
+void
+pgdir_load(pde_t *pgdir)
+{
+	thiscpu->cpu_pgdir = pgdir;
+	lcr3(PADDR(pgdir));
 }
 
 //
-// Invalidate a TLB entry, but only if the page tables being
-// edited are the ones currently in use by the processor.
+// Carry out the TLB shootdown this CPU has been asked for, if any.
+// Called from the IRQ_TLB handler, and by CPUs spinning with
+// interrupts off, so that a CPU waiting on them doesn't wait forever.
+//
+void
+tlb_shootdown_poll(void)
+{
+	struct Cpu *c = thiscpu;
+	int i;
+
+	if (!c->cpu_tlb_pending)
+		return;
+	// Read tlb_req only after seeing the request.
+	asm volatile("" : : : "memory");
+	if (rcr3() == PADDR(tlb_req.pgdir)) {
+		if (tlb_req.count > TLB_BATCH_MAX)
+			lcr3(PADDR(tlb_req.pgdir));
+		else
+			for (i = 0; i < tlb_req.count; i++)
+				invlpg((void *) tlb_req.va[i]);
+	}
+	c->cpu_tlb_pending = 0;
+}
+
+// Send this CPU's batched invalidations in one IPI round and wait for
+// every CPU to act on them, then free the pages they held up.
+static void
+tlb_batch_flush(struct TlbBatch *tb)
+{
+	struct Page *pp;
+	int i;
+
+	if (tb->tb_count) {
+		while (xchg(&tlb_req.busy, 1) != 0) {
+			// The sender may be waiting for us.
+			tlb_shootdown_poll();
+			asm volatile("pause");
+		}
+		tlb_req.pgdir = tb->tb_pgdir;
+		tlb_req.count = tb->tb_count;
+		if (tb->tb_count <= TLB_BATCH_MAX)
+			memmove(tlb_req.va, tb->tb_va, tb->tb_count * sizeof(uintptr_t));
+		// Fill in tlb_req before asking anyone to read it.
+		asm volatile("" : : : "memory");
+		for (i = 0; i < ncpu; i++)
+			if (tb->tb_cpus & (1 << i)) {
+				cpus[i].cpu_tlb_pending = 1;
+				lapic_ipi_cpu(cpus[i].cpu_id, IRQ_OFFSET + IRQ_TLB);
+			}
+		for (i = 0; i < ncpu; i++)
+			while (cpus[i].cpu_tlb_pending)
+				asm volatile("pause");
+		xchg(&tlb_req.busy, 0);
+	}
+	tb->tb_pgdir = NULL;
+	tb->tb_cpus = 0;
+	tb->tb_count = 0;
+
+	while ((pp = tb->tb_free)) {
+		tb->tb_free = pp->pp_link;
+		pp->pp_link = NULL;
+		page_free(pp);
+	}
+}
+
+// Queue the invalidation of 'va', or of everything if 'all', in
+// 'pgdir' for the other CPUs that have it loaded.
+static void
+tlb_shootdown(pde_t *pgdir, uintptr_t va, int all)
+{
+	struct TlbBatch *tb = &thiscpu->cpu_tlb;
+	uint32_t mask = 0;
+	int i;
+
+	// kern_pgdir's mappings don't change once the other CPUs are up.
+	if (pgdir == kern_pgdir)
+		return;
+	// Order the caller's page table writes before reading cpu_pgdir;
+	// a CPU loading pgdir meanwhile will see them.
+	asm volatile("mfence" : : : "memory");
+	for (i = 0; i < ncpu; i++)
+		if (&cpus[i] != thiscpu && cpus[i].cpu_pgdir == pgdir)
+			mask |= 1 << i;
+	if (!mask)
+		return;
+
+	if (tb->tb_count && tb->tb_pgdir != pgdir)
+		tlb_batch_flush(tb);
+	tb->tb_pgdir = pgdir;
+	tb->tb_cpus |= mask;
+	if (!all && tb->tb_count < TLB_BATCH_MAX)
+		tb->tb_va[tb->tb_count++] = va;
+	else
+		tb->tb_count = TLB_BATCH_MAX + 1;
+	if (!tb->tb_depth)
+		tlb_batch_flush(tb);
+}
+
+//
+// Start collecting this CPU's TLB shootdowns, to send them all at once
+// in tlb_batch_end.  Until then, pages that page_remove unmaps from an
+// address space loaded elsewhere are not freed.  Calls nest.
+//
+void
+tlb_batch_begin(void)
+{
+	thiscpu->cpu_tlb.tb_depth++;
+}
+
+void
+tlb_batch_end(void)
+{
+	struct TlbBatch *tb = &thiscpu->cpu_tlb;
+
+	if (--tb->tb_depth == 0)
+		tlb_batch_flush(tb);
+}
+
+//
+// Invalidate a TLB entry on every CPU using the page tables being
+// edited: this one, if they are in use here, and any other.
+// This also forgets the range user_mem_check last passed.
 //
 void
 tlb_invalidate(pde_t *pgdir, void *va)
 {
+	pgdir[PDX(UVPT)] &= ~PDE_UMC_VALID;
 	// Flush the entry only if we're modifying the current address space.
 	if (!curenv || curenv->env_pgdir == pgdir)
 		invlpg(va);
+	tlb_shootdown(pgdir, (uintptr_t) va, 0);
+}
+
+//
+// Invalidate all of 'pgdir's TLB entries, on every CPU using it.
+//
+void
+tlb_flush(pde_t *pgdir)
+{
+	pgdir[PDX(UVPT)] &= ~PDE_UMC_VALID;
+	if (rcr3() == PADDR(pgdir))
+		lcr3(PADDR(pgdir));
+	tlb_shootdown(pgdir, 0, 1);
+}
+
+//
+// Drop a reference to 'pp', which was just unmapped, like page_decref.
+// If TLB shootdowns are batched on this CPU, other CPUs may still reach
+// the page, so it is freed only when the batch is sent.
+//
+static void
+page_decref_unmapped(struct Page *pp)
+{
+	struct TlbBatch *tb = &thiscpu->cpu_tlb;
+	int ref;
+
+	if (!tb->tb_count) {
+		page_decref(pp);
+		return;
+	}
+	spin_lock(&page_lock);
+	ref = --pp->pp_ref;
+	spin_unlock(&page_lock);
+	if (ref == 0) {
+		pp->pp_link = tb->tb_free;
+		tb->tb_free = pp;
+	}
 }
 
 static uintptr_t user_mem_check_addr;
@@ -718,43 +1541,79 @@ int
 user_mem_check(struct Env *env, const void *va, size_t len, int perm)
 {
 	// LAB 3: Your code here.
-	int r = 0;
-	uint32_t v_addr = (uint32_t)va;
-	if (v_addr >= ULIM || (v_addr + len) >= ULIM) {
-		user_mem_check_addr = v_addr > ULIM ? v_addr : ULIM ;
-		r = -E_FAULT;
-	} else {
-		uint32_t va_pgaligned = ROUNDDOWN(v_addr, PGSIZE);
-		len += v_addr - va_pgaligned;
-		uint32_t end_va = va_pgaligned + len;
-		for ( ; va_pgaligned < end_va; va_pgaligned += PGSIZE) {
-			pte_t *ptep = NULL;
-			page_lookup(env->env_pgdir, (void *)va_pgaligned, &ptep);
-			if (ptep) {
-				char msg[20];
-				get_pte_permission_desc(*ptep, msg);
-				//cprintf("pte: %s\n", msg);
-				//cprintf("%08x\n", *ptep);
-			}
-			else
-				cprintf("user_mem_check: no mapping!\n");
-			
-			if (!ptep) {
-				user_mem_check_addr = (va_pgaligned < (uint32_t)va ? 
-					(uint32_t)va : va_pgaligned);
-				r = -E_FAULT;
+	pde_t *pgdir = env->env_pgdir;
+	uintptr_t start = (uintptr_t) va, end, cur, pt_end;
+	pde_t pde;
+	pte_t *pt, pte;
+
+	perm |= PTE_P;
+	if (start >= ULIM || len > ULIM - start) {
+		user_mem_check_addr = start > ULIM ? start : ULIM;
+		return -E_FAULT;
+	}
+	end = start + len;
+
+	// The range last checked for the running env passes again if
+	// nothing in its address space has been unmapped or write-
+	// protected since; tlb_invalidate and tlb_flush clear
+	// PDE_UMC_VALID.  The flag is set before the walk, with a locked
+	// instruction the walk can't run ahead of, so a change made
+	// meanwhile still clears it.
+	if (env == curenv) {
+		if ((pgdir[PDX(UVPT)] & PDE_UMC_VALID)
+		    && start >= env->env_umc_start && end <= env->env_umc_end
+		    && (perm & env->env_umc_perm) == perm)
+			return 0;
+		env->env_umc_start = env->env_umc_end = 0;
+		asm volatile("lock; orl %1, %0"
+			     : "+m" (pgdir[PDX(UVPT)]) : "r" (PDE_UMC_VALID)
+			     : "cc", "memory");
+	}
+
+	// One page directory entry, and at most one page table, per 4MB.
+	for (cur = ROUNDDOWN(start, PGSIZE); cur < end; cur = pt_end) {
+		pt_end = ROUNDDOWN(cur, PTSIZE) + PTSIZE;
+		pde = pgdir[PDX(cur)];
+		// As for a copy-on-write page below.
+		if ((perm & PTE_W) && cur < UTOP
+		    && (pde & (PTE_P | PTE_PS | PTE_COW))
+		       == (PTE_P | PTE_PS | PTE_COW)) {
+			env_lock(env);
+			page_cow(pgdir, (void *) cur);
+			env_unlock(env);
+			pde = pgdir[PDX(cur)];
+		}
+		if ((pde & PTE_PS) && (pde & perm) == perm)
+			continue;
+		pt = (pde & PTE_P) && !(pde & PTE_PS)
+			? (pte_t *) KADDR(PTE_ADDR(pde)) : NULL;
+		for (; cur < end && cur < pt_end; cur += PGSIZE) {
+			pte = pt ? pt[PTX(cur)] : 0;
+			// The kernel is about to write a copy-on-write page
+			// on env's behalf: give env its own copy first.
+			if ((perm & PTE_W) && cur < UTOP && pt
+			    && ((pde & PTE_COW)
+				|| (pte & (PTE_P | PTE_COW)) == (PTE_P | PTE_COW))) {
+				env_lock(env);
+				page_cow(pgdir, (void *) cur);
+				env_unlock(env);
+				pde = pgdir[PDX(cur)];
+				pt = (pte_t *) KADDR(PTE_ADDR(pde));
+				pte = pt[PTX(cur)];
 			}
-			
-			if ((*ptep & (perm | PTE_P)) != (perm | PTE_P)) {
-				if (perm & PTE_W) { //check if has COPY_ON_WRITE
-				} 
-				user_mem_check_addr = (va_pgaligned < (uint32_t)va ? 
-					(uint32_t)va : va_pgaligned);
-				r = -E_FAULT;
+			if ((pde & pte & perm) != perm) {
+				user_mem_check_addr = cur < start ? start : cur;
+				return -E_FAULT;
 			}
-		} 
+		}
 	}
-	return r;
+
+	if (env == curenv) {
+		env->env_umc_start = start;
+		env->env_umc_end = end;
+		env->env_umc_perm = perm;
+	}
+	return 0;
 }
 
 //
@@ -780,7 +1639,45 @@ user_mem_assert(struct Env *env, const void *va, size_t len, int perm)
 // --------------------------------------------------------------
 
 //
-// Check that the pages on the page_free_list are reasonable.
+// Check one page found on the free lists or in a page cache.
+//
+static void
+check_free_page(struct Page *pp, unsigned pdx_limit,
+		int *nfree_basemem, int *nfree_extmem)
+{
+	char *first_free_page = (char *) boot_alloc(0);
+
+	// check that we didn't corrupt the free lists themselves
+	assert(pp >= pages);
+	assert(pp < pages + npages);
+	assert(((char *) pp - (char *) pages) % sizeof(*pp) == 0);
+	assert(pp->pp_ref == 0);
+
+	// if there's a page that shouldn't be on the free list,
+	// try to make sure it eventually causes trouble.
+	if (PDX(page2pa(pp)) < pdx_limit)
+		memset(page2kva(pp), 0x97, 128);
+
+	// check a few pages that shouldn't be on the free list
+	assert(page2pa(pp) != 0);
+	assert(page2pa(pp) != IOPHYSMEM);
+	assert(page2pa(pp) != EXTPHYSMEM - PGSIZE);
+	assert(page2pa(pp) != EXTPHYSMEM);
+	assert(page2pa(pp) < EXTPHYSMEM || (char *) page2kva(pp) >= first_free_page);
+	// (new test for lab 4)
+	assert(page2pa(pp) != MPENTRY_PADDR);
+
+	if (page2pa(pp) < EXTPHYSMEM)
+		++*nfree_basemem;
+	else
+		++*nfree_extmem;
+}
+
+//
+// Check that the pages on the free lists are reasonable.
+// (The buddy allocator hands out the lowest blocks first, see
+// page_init, so unlike a plain free list nothing needs reordering
+// for entry_pgdir's sake when only_low_memory is set.)
 //
 static void
 check_page_free_list(bool only_low_memory)
@@ -788,60 +1685,60 @@ check_page_free_list(bool only_low_memory)
 	struct Page *pp;
 	unsigned pdx_limit = only_low_memory ? 1 : NPDENTRIES;
 	int nfree_basemem = 0, nfree_extmem = 0;
-	char *first_free_page;
-
-	if (!page_free_list)
-		panic("'page_free_list' is a null pointer!");
-
-	if (only_low_memory) {
-		// Move pages with lower addresses first in the free
-		// list, since entry_pgdir does not map all pages.
-		struct Page *pp1, *pp2;
-		struct Page **tp[2] = { &pp1, &pp2 };
-		for (pp = page_free_list; pp; pp = pp->pp_link) {
-			int pagetype = PDX(page2pa(pp)) >= pdx_limit;
-			*tp[pagetype] = pp;
-			tp[pagetype] = &pp->pp_link;
+	int order, i;
+
+	for (order = 0; order <= PAGE_MAX_ORDER; order++)
+		for (pp = page_free_area[order]; pp; pp = pp->pp_link) {
+			assert(pp->pp_free && pp->pp_order == order);
+			assert((pp - pages) % (1 << order) == 0);
+			assert(!pp->pp_link || pp->pp_link->pp_prev == pp);
+			for (i = 0; i < (1 << order); i++)
+				check_free_page(pp + i, pdx_limit,
+						&nfree_basemem, &nfree_extmem);
 		}
-		*tp[1] = 0;
-		*tp[0] = pp2;
-		page_free_list = pp1;
-	}
-	
-	//print_freepageinfo();
-
-	// if there's a page that shouldn't be on the free list,
-	// try to make sure it eventually causes trouble.
-	for (pp = page_free_list; pp; pp = pp->pp_link)
-		if (PDX(page2pa(pp)) < pdx_limit)
-			memset(page2kva(pp), 0x97, 128);
-
-	first_free_page = (char *) boot_alloc(0);
-	for (pp = page_free_list; pp; pp = pp->pp_link) {
-		// check that we didn't corrupt the free list itself
-		assert(pp >= pages);
-		assert(pp < pages + npages);
-		assert(((char *) pp - (char *) pages) % sizeof(*pp) == 0);
-
-		// check a few pages that shouldn't be on the free list
-		assert(page2pa(pp) != 0);
-		assert(page2pa(pp) != IOPHYSMEM);
-		assert(page2pa(pp) != EXTPHYSMEM - PGSIZE);
-		assert(page2pa(pp) != EXTPHYSMEM);
-		assert(page2pa(pp) < EXTPHYSMEM || (char *) page2kva(pp) >= first_free_page);
-		// (new test for lab 4)
-		assert(page2pa(pp) != MPENTRY_PADDR);
-
-		if (page2pa(pp) < EXTPHYSMEM)
-			++nfree_basemem;
-		else
-			++nfree_extmem;
-	}
+	for (pp = thiscpu->cpu_pcache.pc_head; pp; pp = pp->pp_link)
+		check_free_page(pp, pdx_limit, &nfree_basemem, &nfree_extmem);
 
 	assert(nfree_basemem > 0);
 	assert(nfree_extmem > 0);
 }
 
+// Count the pages on the free lists and in this CPU's page cache.
+static int
+check_nfree(void)
+{
+	struct Page *pp;
+	int order, nfree = 0;
+
+	for (order = 0; order <= PAGE_MAX_ORDER; order++)
+		for (pp = page_free_area[order]; pp; pp = pp->pp_link)
+			nfree += 1 << order;
+	for (pp = thiscpu->cpu_pcache.pc_head; pp; pp = pp->pp_link)
+		nfree++;
+	return nfree;
+}
+
+// Temporarily take all free pages away from the allocator, saving
+// them in 'fa' and 'pc'; check_return_free gives them back.
+static void
+check_steal_free(struct Page **fa, struct PageCache *pc)
+{
+	memmove(fa, page_free_area, sizeof(page_free_area));
+	memset(page_free_area, 0, sizeof(page_free_area));
+	pc->pc_head = thiscpu->cpu_pcache.pc_head;
+	pc->pc_count = thiscpu->cpu_pcache.pc_count;
+	thiscpu->cpu_pcache.pc_head = NULL;
+	thiscpu->cpu_pcache.pc_count = 0;
+}
+
+static void
+check_return_free(struct Page **fa, struct PageCache *pc)
+{
+	memmove(page_free_area, fa, sizeof(page_free_area));
+	thiscpu->cpu_pcache.pc_head = pc->pc_head;
+	thiscpu->cpu_pcache.pc_count = pc->pc_count;
+}
+
 //
 // Check the physical page allocator (page_alloc(), page_free(),
 // and page_init()).
@@ -851,7 +1748,8 @@ check_page_alloc(void)
 {
 	struct Page *pp, *pp0, *pp1, *pp2;
 	int nfree;
-	struct Page *fl;
+	struct Page *fl[PAGE_MAX_ORDER + 1];
+	struct PageCache pc;
 	char *c;
 	int i;
 
@@ -859,8 +1757,7 @@ check_page_alloc(void)
 		panic("'pages' is a null pointer!");
 
 	// check number of free pages
-	for (pp = page_free_list, nfree = 0; pp; pp = pp->pp_link)
-		++nfree;
+	nfree = check_nfree();
 
 	// should be able to allocate three pages
 	pp0 = pp1 = pp2 = 0;
@@ -876,8 +1773,7 @@ check_page_alloc(void)
 	assert(page2pa(pp2) < npages*PGSIZE);
 
 	// temporarily steal the rest of the free pages
-	fl = page_free_list;
-	page_free_list = 0;
+	check_steal_free(fl, &pc);
 
 	// should be no free memory
 	assert(!page_alloc(0));
@@ -905,7 +1801,7 @@ check_page_alloc(void)
 		assert(c[i] == 0);
 
 	// give free list back
-	page_free_list = fl;
+	check_return_free(fl, &pc);
 
 	// free the pages we took
 	page_free(pp0);
@@ -913,9 +1809,19 @@ check_page_alloc(void)
 	page_free(pp2);
 
 	// number of free pages should be the same
-	for (pp = page_free_list; pp; pp = pp->pp_link)
-		--nfree;
-	assert(nfree == 0);
+	assert(nfree == check_nfree());
+
+	// contiguous blocks should be aligned, distinct, and merge back
+	assert((pp0 = page_alloc_order(3, 0)));
+	assert((pp1 = page_alloc_order(3, ALLOC_ZERO)));
+	assert(pp0 != pp1);
+	assert((pp0 - pages) % 8 == 0 && (pp1 - pages) % 8 == 0);
+	c = page2kva(pp1);
+	for (i = 0; i < 8 * PGSIZE; i++)
+		assert(c[i] == 0);
+	page_free_order(pp0, 3);
+	page_free_order(pp1, 3);
+	assert(nfree == check_nfree());
 
 	//cprintf("check_page_alloc() succeeded!\n");
 }
@@ -946,6 +1852,9 @@ check_kern_pgdir(void)
 	for (i = 0; i < n; i += PGSIZE)
 		assert(check_va2pa(pgdir, UENVS + i) == PADDR(envs) + i);
 
+	// check the time page
+	assert(check_va2pa(pgdir, UTIME) == PADDR(timepage));
+
 	// check phys mem
 	for (i = 0; i < npages * PGSIZE; i += PGSIZE)
 		assert(check_va2pa(pgdir, KERNBASE + i) == i);
@@ -1017,7 +1926,8 @@ static void
 check_page(void)
 {
 	struct Page *pp, *pp0, *pp1, *pp2;
-	struct Page *fl;
+	struct Page *fl[PAGE_MAX_ORDER + 1];
+	struct PageCache pc;
 	pte_t *ptep, *ptep1;
 	void *va;
 	int i;
@@ -1034,8 +1944,7 @@ check_page(void)
 	assert(pp2 && pp2 != pp1 && pp2 != pp0);
 
 	// temporarily steal the rest of the free pages
-	fl = page_free_list;
-	page_free_list = 0;
+	check_steal_free(fl, &pc);
 
 	// should be no free memory
 	assert(!page_alloc(0));
@@ -1145,7 +2054,7 @@ check_page(void)
 	pp0->pp_ref = 0;
 
 	// give free list back
-	page_free_list = fl;
+	check_return_free(fl, &pc);
 
 	// free the pages we took
 	page_free(pp0);
@@ -1201,23 +2110,22 @@ void
 print_freepageinfo()
 {
 	int free_pages = 0;
-	int i;
+	int i, n;
+	struct Page *pp;
 	for (i=0; i<npages; i++)
 		if (pages[i].pp_ref == 0)
 			free_pages++;
 	cprintf("total_pages = %d, free_pages = %d\n", npages, free_pages);
-	cprintf("free page list:\n");
-	struct Page *pp = page_free_list;
-	for (i=1; i<=free_pages; i++) {
-		if( pp-pages < 0)
-			break;
-		cprintf("%5d   ",pp-pages);
-		if (i % 10 == 0 && i != 0)
-			cprintf("\n");
-		else if (i+1 == free_pages)
-			cprintf("\n");
-		pp = pp->pp_link;
-		
+	cprintf("free blocks by order:\n");
+	spin_lock(&page_lock);
+	for (i = 0; i <= PAGE_MAX_ORDER; i++) {
+		for (n = 0, pp = page_free_area[i]; pp; pp = pp->pp_link)
+			n++;
+		cprintf("%5d: %d\n", i, n);
 	}
-	
+	spin_unlock(&page_lock);
+	for (i = 0; i < ncpu; i++)
+		cprintf("cpu %d cache: %d\n", i, cpus[i].cpu_pcache.pc_count);
+	cprintf("zeroed pool: %d, hits %u, misses %u\n",
+		page_zero_count, page_zero_hits, page_zero_misses);
 }
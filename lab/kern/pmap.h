@@ -51,18 +51,34 @@ enum {
 	ALLOC_ZERO = 1<<0,
 };
 
+// page_alloc_order hands out blocks of up to 2^PAGE_MAX_ORDER pages (4MB).
+#define PAGE_MAX_ORDER	10
+
 void	mem_init(void);
 void	boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm);
+void	boot_map_region_large(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm);
 
 void	page_init(void);
 struct Page *page_alloc(int alloc_flags);
 void	page_free(struct Page *pp);
+struct Page *page_alloc_order(int order, int alloc_flags);
+void	page_free_order(struct Page *pp, int order);
+int	page_prezero(void);
 int	page_insert(pde_t *pgdir, struct Page *pp, void *va, int perm);
-void	page_remove(pde_t *pgdir, void *va);
+int	page_remove(pde_t *pgdir, void *va);
 struct Page *page_lookup(pde_t *pgdir, void *va, pte_t **pte_store);
 void	page_decref(struct Page *pp);
 
+// Set, in a page directory's UVPT entry (bits the MMU ignores), while
+// its env's env_umc_* range is known to pass user_mem_check.
+#define PDE_UMC_VALID	0x200
+
+void	pgdir_load(pde_t *pgdir);
 void	tlb_invalidate(pde_t *pgdir, void *va);
+void	tlb_flush(pde_t *pgdir);
+void	tlb_batch_begin(void);
+void	tlb_batch_end(void);
+void	tlb_shootdown_poll(void);
 
 int	user_mem_check(struct Env *env, const void *va, size_t len, int perm);
 void	user_mem_assert(struct Env *env, const void *va, size_t len, int perm);
@@ -89,5 +105,11 @@ page2kva(struct Page *pp)
 }
 
 pte_t *pgdir_walk(pde_t *pgdir, const void *va, int create);
+int	pgdir_fork(pde_t *dst, pde_t *src);
+int	pgtable_unshare(pde_t *pgdir, void *va);
+int	pgtable_release(pde_t *pgdir, uint32_t pdeno);
+void	pgtable_decref(struct Page *pp);
+int	page_cow(pde_t *pgdir, void *va);
+int	superpage_insert(pde_t *pgdir, struct Page *pp, void *va, int perm);
 
 #endif /* !JOS_KERN_PMAP_H */
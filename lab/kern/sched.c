@@ -1,92 +1,554 @@
 #include <inc/assert.h>
+#include <inc/x86.h>
 
 #include <kern/env.h>
 #include <kern/pmap.h>
 #include <kern/monitor.h>
+#include <kern/sched.h>
+#include <kern/cpu.h>
+#include <kern/spinlock.h>
+#include <kern/e1000.h>
+#include <kern/syscall.h>
 
+// Lock ordering: env locks (see env_lock_pair) are taken before run
+// queue locks.  A run queue lock is never held while taking anything
+// but the page allocator's locks.
+
+// Scheduling is a multi-level feedback queue.  The timer preempts an
+// env only once it has run SCHED_QUANTUM(level) ticks at its level, or
+// when an env of a higher level is queued on its CPU.  An env that
+// uses up its quantum drops one level, so the lower levels, where
+// CPU-bound envs end up, get longer time slices; an env that blocks in
+// sys_ipc_recv or sys_net_recv returns to its static priority, so
+// servers waiting on requests stay ahead of CPU-bound work.  Every
+// SCHED_BOOST_TICKS timer ticks each CPU lifts its queued envs back to
+// their static priority, so demoted envs are never starved for good.
+#define SCHED_BOOST_TICKS	100
+#define SCHED_QUANTUM(prio)	(1 << (prio))
+
+// Pages a CPU zeroes for the page allocator each time it goes idle.
+#define PREZERO_BATCH		8
+
+// Set by the first CPU to find the system idle, so that only one
+// CPU drops into the kernel monitor.
+static volatile uint32_t sched_monitor;
 
-// Choose a user environment to run and run it.
 void
-sched_yield(void)
+sched_init(void)
 {
-	struct Env *idle;
 	int i;
 
-	// Implement simple round-robin scheduling.
-	//
-	// Search through 'envs' for an ENV_RUNNABLE environment in
-	// circular fashion starting just after the env this CPU was
-	// last running.  Switch to the first such environment found.
-	//
-	// If no envs are runnable, but the environment previously
-	// running on this CPU is still ENV_RUNNING, it's okay to
-	// choose that environment.
-	//
-	// Never choose an environment that's currently running on
-	// another CPU (env_status == ENV_RUNNING) and never choose an
-	// idle environment (env_type == ENV_TYPE_IDLE).  If there are
-	// no runnable environments, simply drop through to the code
-	// below to switch to this CPU's idle environment.
-
-	// LAB 4: Your code here.
-	struct Env *next_env = NULL;
-	int find_start_i = -1;
-	if (!curenv)
-		find_start_i = 0;
-	else 
-		find_start_i = (curenv - envs) + 1;
-		
-	//cprintf("find_sart_i = %d\n", find_start_i);
-	
-	int find_count;
-	for (find_count = 0, i = find_start_i; find_count < NENV - 1; i++, find_count++) {
-		i = i % NENV;
-		if (envs[i].env_status == ENV_RUNNABLE 
-		 && envs[i].env_type != ENV_TYPE_IDLE) {
-			next_env = envs + i;
+	for (i = 0; i < NCPU; i++)
+		spin_initlock(&cpus[i].cpu_runq.rq_lock);
+}
+
+// Append 'e' to the tail of its priority level in run queue 'rq'.
+// The caller must hold rq->rq_lock.
+static void
+runq_push(struct Runq *rq, struct Env *e)
+{
+	int p = e->env_prio;
+
+	e->env_rq_next = NULL;
+	e->env_rq_prev = rq->rq_tail[p];
+	if (rq->rq_tail[p])
+		rq->rq_tail[p]->env_rq_next = e;
+	else
+		rq->rq_head[p] = e;
+	rq->rq_tail[p] = e;
+	rq->rq_len++;
+}
+
+// Unlink 'e' from its priority level in run queue 'rq'.
+// The caller must hold rq->rq_lock.
+static void
+runq_unlink(struct Runq *rq, struct Env *e)
+{
+	int p = e->env_prio;
+
+	if (e->env_rq_prev)
+		e->env_rq_prev->env_rq_next = e->env_rq_next;
+	else
+		rq->rq_head[p] = e->env_rq_next;
+	if (e->env_rq_next)
+		e->env_rq_next->env_rq_prev = e->env_rq_prev;
+	else
+		rq->rq_tail[p] = e->env_rq_prev;
+	e->env_rq_next = e->env_rq_prev = NULL;
+	rq->rq_len--;
+}
+
+// Take 'e' off run queue 'rq' for good.
+// The caller must hold rq->rq_lock.
+static void
+runq_remove(struct Runq *rq, struct Env *e)
+{
+	runq_unlink(rq, e);
+	e->env_rq_cpu = -1;
+}
+
+// Remove and return the oldest env on the highest non-empty
+// priority level of run queue 'rq', or NULL if the queue is empty.
+static struct Env *
+runq_pop(struct Runq *rq)
+{
+	struct Env *e = NULL;
+	int p;
+
+	if (!rq->rq_len)
+		return NULL;
+	spin_lock(&rq->rq_lock);
+	for (p = 0; p < NPRIO; p++)
+		if ((e = rq->rq_head[p])) {
+			runq_remove(rq, e);
 			break;
 		}
+	spin_unlock(&rq->rq_lock);
+	return e;
+}
+
+// Choose the CPU whose run queue 'e' should join.  Pinned envs
+// always go to their CPU.  Otherwise affinity is soft: prefer the
+// CPU the env last ran on, whose caches are likely still warm, and
+// leave it to idle CPUs to steal work when queues get unbalanced.
+static int
+sched_pick_cpu(struct Env *e)
+{
+	if (e->env_affinity >= 0)
+		return e->env_affinity;
+	if (e->env_runs > 0)
+		return e->env_cpunum;
+	return cpunum();
+}
+
+// An env was just queued on CPU 'cpu'.  If that CPU is halted in
+// sched_halt, send it a wakeup IPI.  If it is busy and the env may run
+// anywhere, wake some other halted CPU instead, which will steal it.
+//
+// The run queue lock was released (with xchg) before this reads
+// cpu_halted, and sched_halt sets cpu_halted (with xchg) before its
+// last look at the run queues, so a CPU never halts with the env
+// unseen and no IPI on its way.
+static void
+sched_wakeup(int cpu, bool pinned)
+{
+	int i, me = cpunum();
+
+	if (cpus[cpu].cpu_halted) {
+		if (cpu != me)
+			lapic_ipi_cpu(cpus[cpu].cpu_id, IRQ_OFFSET + IRQ_WAKEUP);
+		return;
 	}
-	
-	if (next_env == NULL && curenv && curenv->env_status == ENV_RUNNING 
-			&& curenv->env_cpunum == thiscpu->cpu_id) 
-		next_env = curenv;
-		
-	if (next_env) 
-		env_run(next_env);  //not return
-	
-	//cprintf("not found next env\n");
-
-	// For debugging and testing purposes, if there are no
-	// runnable environments other than the idle environments,
-	// drop into the kernel monitor.
-	// NOTE: because of receive interrupt, we must jump into ENV_TYPE_IDLE.
-	// Otherwise, when there is no env running, and packet receive, but in
-	// kernel mode, we can't receive hardware interrupt.
-	// So, we check whether there is any env waiting for NIC receive interrupt.
-	// if no, we just run into kernel monitor, or we run idle. 
-	int env_net_recv = 0;
-	for (i = 0; i < NENV; i++) {
-		if (envs[i].env_net_recving) {
-			env_net_recv = 1;
-			break;
+	if (pinned)
+		return;
+	for (i = 0; i < ncpu; i++)
+		if (i != me && cpus[i].cpu_halted) {
+			lapic_ipi_cpu(cpus[i].cpu_id, IRQ_OFFSET + IRQ_WAKEUP);
+			return;
 		}
+}
+
+// Put runnable env 'e' on a run queue.
+// The caller must hold e's lock.
+static void
+sched_queue(struct Env *e)
+{
+	struct Runq *rq;
+	int cpu;
+
+	cpu = sched_pick_cpu(e);
+	rq = &cpus[cpu].cpu_runq;
+	spin_lock(&rq->rq_lock);
+	e->env_rq_cpu = cpu;
+	runq_push(rq, e);
+	spin_unlock(&rq->rq_lock);
+	sched_wakeup(cpu, e->env_affinity >= 0);
+}
+
+// Mark 'e' ENV_RUNNABLE and put it on a run queue.
+// The caller must hold e's lock.
+void
+sched_enqueue(struct Env *e)
+{
+	e->env_status = ENV_RUNNABLE;
+	if (e->env_rq_cpu >= 0)
+		return;
+	e->env_tsc_stamp = read_tsc();
+	sched_queue(e);
+}
+
+// Take 'e' off whatever run queue it is on.
+// Called whenever 'e' stops being ENV_RUNNABLE.
+// The caller must hold e's lock.
+void
+sched_dequeue(struct Env *e)
+{
+	struct Runq *rq;
+	int cpu;
+
+	if ((cpu = e->env_rq_cpu) < 0)
+		return;
+	rq = &cpus[cpu].cpu_runq;
+	spin_lock(&rq->rq_lock);
+	// Another CPU may have popped it in the meantime.
+	if (e->env_rq_cpu == cpu)
+		runq_remove(rq, e);
+	spin_unlock(&rq->rq_lock);
+}
+
+// Return the wait histogram bucket for a wait of 'cycles'.
+static int
+sched_hist_bucket(uint64_t cycles)
+{
+	int i;
+
+	for (i = 0; i < SCHED_HIST_BUCKETS - 1 && cycles > 1; i++)
+		cycles >>= 1;
+	return i;
+}
+
+// Try to claim 'e', just taken off a run queue, for this CPU.
+// Between the pop and now it may have been destroyed, blocked, or
+// requeued; only an env that is still runnable and on no queue can
+// be claimed, and then only by one CPU.
+static bool
+sched_claim(struct Env *e)
+{
+	uint64_t now, wait;
+	bool ok;
+
+	env_lock(e);
+	if ((ok = (e->env_status == ENV_RUNNABLE && e->env_rq_cpu < 0))) {
+		e->env_status = ENV_RUNNING;
+		e->env_cpunum = cpunum();
+
+		now = read_tsc();
+		wait = now - e->env_tsc_stamp;
+		e->env_wait_cycles += wait;
+		e->env_tsc_stamp = now;
+		thiscpu->cpu_stats.ss_wait_hist[sched_hist_bucket(wait)]++;
 	}
-	
-	for (i = 0; i < NENV; i++) {
-		if ( (env_net_recv ? 1 : envs[i].env_type != ENV_TYPE_IDLE) &&
-		    (envs[i].env_status == ENV_RUNNABLE || envs[i].env_status == ENV_RUNNING))
+	env_unlock(e);
+	return ok;
+}
+
+// 'e' stops running on this CPU: charge it for the time since it
+// was claimed.
+// The caller must hold e's lock.
+void
+sched_stop(struct Env *e)
+{
+	e->env_run_cycles += read_tsc() - e->env_tsc_stamp;
+}
+
+// Called when this CPU's run queue is empty: steal the best env
+// that isn't pinned elsewhere from the busiest other run queue.
+// Returns NULL if there is nothing to steal.
+static struct Env *
+sched_steal(void)
+{
+	struct Runq *rq;
+	struct Env *e = NULL;
+	int i, p, me = cpunum(), busiest = -1, len = 0;
+
+	// Queue lengths are only a hint, so read them unlocked.
+	for (i = 0; i < ncpu; i++)
+		if (i != me && cpus[i].cpu_runq.rq_len > len) {
+			busiest = i;
+			len = cpus[i].cpu_runq.rq_len;
+		}
+	if (busiest < 0)
+		return NULL;
+
+	rq = &cpus[busiest].cpu_runq;
+	spin_lock(&rq->rq_lock);
+	for (p = 0; p < NPRIO && !e; p++)
+		for (e = rq->rq_head[p]; e; e = e->env_rq_next)
+			if (e->env_affinity < 0 || e->env_affinity == me) {
+				runq_remove(rq, e);
+				break;
+			}
+	spin_unlock(&rq->rq_lock);
+	return e;
+}
+
+// Pin 'e' to CPU 'cpu', or unpin it if cpu is -1.  A queued env
+// moves to its new CPU's queue at once; a running one moves the
+// next time it is queued.
+// The caller must hold e's lock.
+void
+sched_set_affinity(struct Env *e, int cpu)
+{
+	e->env_affinity = cpu;
+	if (e->env_rq_cpu >= 0 && cpu >= 0 && e->env_rq_cpu != cpu) {
+		sched_dequeue(e);
+		sched_queue(e);
+	}
+}
+
+// Set e's static priority, and move it to that level right away.
+// The caller must hold e's lock.
+void
+sched_set_priority(struct Env *e, int prio)
+{
+	bool queued = e->env_rq_cpu >= 0;
+
+	if (queued)
+		sched_dequeue(e);
+	e->env_prio = e->env_base_prio = prio;
+	e->env_slice_ticks = 0;
+	if (queued)
+		sched_queue(e);
+}
+
+// Called on every timer interrupt on this CPU.  Charge curenv a tick,
+// and demote it one level if it has used up its level's quantum; and
+// every so often lift the envs queued here back to their static
+// priorities.  Returns true if the caller should call sched_yield:
+// curenv's quantum is used up, an env of a higher level is queued
+// here, or this CPU has no env running.
+bool
+sched_tick(void)
+{
+	struct Runq *rq = &thiscpu->cpu_runq;
+	struct Env *e, *next;
+	bool preempt = !curenv;
+	int p, prio = NPRIO;
+
+	if (curenv) {
+		env_lock(curenv);
+		if (++curenv->env_slice_ticks >= SCHED_QUANTUM(curenv->env_prio)) {
+			if (curenv->env_prio < ENV_PRIO_LOW)
+				curenv->env_prio++;
+			curenv->env_slice_ticks = 0;
+			preempt = 1;
+		}
+		if (curenv->env_status != ENV_RUNNING)
+			preempt = 1;
+		prio = curenv->env_prio;
+		env_unlock(curenv);
+	}
+
+	spin_lock(&rq->rq_lock);
+	if (++rq->rq_ticks >= SCHED_BOOST_TICKS) {
+		rq->rq_ticks = 0;
+		for (p = 1; p < NPRIO; p++)
+			for (e = rq->rq_head[p]; e; e = next) {
+				next = e->env_rq_next;
+				if (e->env_base_prio < p) {
+					runq_unlink(rq, e);
+					e->env_prio = e->env_base_prio;
+					e->env_slice_ticks = 0;
+					runq_push(rq, e);
+				}
+			}
+	}
+	for (p = 0; p < prio && !preempt; p++)
+		if (rq->rq_head[p])
+			preempt = 1;
+	spin_unlock(&rq->rq_lock);
+	thiscpu->cpu_preempted = preempt;
+	return preempt;
+}
+
+// Returns true if any CPU is running an environment.
+static bool
+sched_cpus_busy(void)
+{
+	struct Env *e;
+	int i;
+
+	for (i = 0; i < ncpu; i++) {
+		e = cpus[i].cpu_env;
+		if (e && e->env_status == ENV_RUNNING)
+			return 1;
+	}
+	return 0;
+}
+
+// Halt this CPU until an interrupt arrives: a timer tick, or a wakeup
+// IPI from a CPU that queued an env for us.  The interrupt enters
+// trap() in kernel mode, which calls sched_yield, so this never
+// returns.
+static void
+sched_halt(void)
+{
+	struct Env *e = curenv;
+	int i;
+
+	// curenv may still be ENV_RUNNING if it was pinned to another
+	// CPU; hand it over to that CPU.
+	curenv = NULL;
+	pgdir_load(kern_pgdir);
+	if (e) {
+		env_lock(e);
+		sched_stop(e);
+		if (e->env_status == ENV_RUNNING)
+			sched_enqueue(e);
+		else if (e->env_status == ENV_DYING)
+			env_free(e);
+		env_unlock(e);
+	}
+
+	// Spend a little of the idle time zeroing pages for ALLOC_ZERO.
+	// Interrupts are still off, so do only a few: a wakeup IPI waits
+	// until we are done.
+	for (i = 0; i < PREZERO_BATCH && !thiscpu->cpu_runq.rq_len; i++)
+		if (!page_prezero())
 			break;
+
+	// Nothing on this stack is needed any more, so reset the stack
+	// pointer to its top, enable interrupts and halt.
+	thiscpu->cpu_halt_stamp = read_tsc();
+	asm volatile (
+		"movl $0, %%ebp\n"
+		"movl %0, %%esp\n"
+		"pushl $0\n"
+		"pushl $0\n"
+		"sti\n"
+		"1:\n"
+		"hlt\n"
+		"jmp 1b\n"
+	: : "a" (thiscpu->cpu_ts.ts_esp0));
+}
+
+// Block curenv and give up the CPU.  The caller holds curenv's lock
+// and has recorded what curenv is waiting for; the lock is released
+// here, once curenv is ENV_NOT_RUNNABLE and this CPU has switched
+// off its page directory, so the waker may run it anywhere.
+void
+sched_block(void)
+{
+	struct Env *e = curenv;
+
+	curenv = NULL;
+	pgdir_load(kern_pgdir);
+	sched_stop(e);
+	e->env_vol_switches++;
+	if (e->env_status == ENV_DYING)
+		env_free(e);
+	else {
+		// Blocking on I/O or IPC earns back the static priority.
+		e->env_status = ENV_NOT_RUNNABLE;
+		e->env_prio = e->env_base_prio;
+		e->env_slice_ticks = 0;
+	}
+	env_unlock(e);
+	sched_yield();
+}
+
+// Block curenv, as sched_block does, and run 'e' on this CPU in its
+// place, without a trip through the run queues: e gets the rest of
+// curenv's time slice.  For an IPC call, where curenv waits for e's
+// reply.  The caller holds the locks of curenv and of e, which must
+// be ENV_NOT_RUNNABLE; both are released here.  If e is pinned to
+// another CPU, it is queued there instead.
+void
+sched_handoff(struct Env *e)
+{
+	struct Env *prev = curenv;
+	uint64_t now;
+
+	if (e->env_affinity >= 0 && e->env_affinity != cpunum()) {
+		sched_enqueue(e);
+		env_unlock(e);
+		sched_block();
+	}
+
+	// Claim e, as sched_claim would.  It never waited on a queue.
+	now = read_tsc();
+	e->env_status = ENV_RUNNING;
+	e->env_cpunum = cpunum();
+	e->env_tsc_stamp = now;
+	e->env_runs++;
+	env_unlock(e);
+	thiscpu->cpu_stats.ss_handoffs++;
+
+	// Block prev, and let go of it only once we are off its page
+	// directory (see sched_block).
+	sched_stop(prev);
+	prev->env_vol_switches++;
+	curenv = e;
+	pgdir_load(e->env_pgdir);
+	if (prev->env_status == ENV_DYING)
+		env_free(prev);
+	else {
+		prev->env_status = ENV_NOT_RUNNABLE;
+		prev->env_prio = prev->env_base_prio;
+		prev->env_slice_ticks = 0;
 	}
-	if (i == NENV) {
-		cprintf("No more runnable environments!\n");
-		while (1)
-			monitor(NULL);
+	env_unlock(prev);
+	env_pop_tf(&e->env_tf);
+}
+
+// Choose a user environment to run and run it.
+void
+sched_yield(void)
+{
+	struct Env *next_env;
+	bool preempted = thiscpu->cpu_preempted;
+
+	thiscpu->cpu_preempted = 0;
+	thiscpu->cpu_halted = 0;
+	if (thiscpu->cpu_halt_stamp) {
+		thiscpu->cpu_stats.ss_idle_cycles +=
+			read_tsc() - thiscpu->cpu_halt_stamp;
+		thiscpu->cpu_halt_stamp = 0;
 	}
 
-	// Run this CPU's idle environment when nothing else is runnable.
-	idle = &envs[cpunum()];
-	if (!(idle->env_status == ENV_RUNNABLE || idle->env_status == ENV_RUNNING))
-		panic("CPU %d: No idle environment!", cpunum());
-	env_run(idle);
+	// Reap curenv if another CPU destroyed it while it was
+	// in the kernel.
+	if (curenv && curenv->env_status == ENV_DYING)
+		env_destroy(curenv);
+
+	while (1) {
+		// Runnable environments sit on per-CPU run queues, so
+		// picking the next one is O(NPRIO): take the best env on
+		// this CPU's queue, or steal from another CPU if ours is
+		// empty.
+		while ((next_env = runq_pop(&thiscpu->cpu_runq))
+		       || (next_env = sched_steal()))
+			if (sched_claim(next_env)) {
+				// The timer took the CPU from a curenv
+				// that still wanted it.
+				if (preempted && curenv
+				    && curenv->env_status == ENV_RUNNING)
+					curenv->env_invol_switches++;
+				thiscpu->cpu_halted = 0;
+				env_run(next_env);  //not return
+			}
+
+		// Second time around, after announcing the halt below,
+		// and still nothing to do.
+		if (thiscpu->cpu_halted)
+			sched_halt();
+
+		// If no envs are runnable, but the environment previously
+		// running on this CPU is still ENV_RUNNING, it's okay to
+		// choose that environment, unless it has been pinned to
+		// another CPU.
+		if (curenv && curenv->env_status == ENV_RUNNING
+		    && (curenv->env_affinity < 0
+			|| curenv->env_affinity == cpunum()))
+			env_run(curenv);
+
+		// For debugging and testing purposes, if there are no
+		// runnable environments, drop into the kernel monitor.
+		// The monitor polls the console with interrupts off, so
+		// if an environment is waiting for the NIC receive
+		// interrupt (suspend_env), or for a timeout that the
+		// timer interrupt runs out (ipc_tick), halt instead.
+		if (!suspend_env && !ipc_timeouts_pending()
+		    && !sched_cpus_busy()
+		    && xchg(&sched_monitor, 1) == 0) {
+			cprintf("No more runnable environments!\n");
+			while (1)
+				monitor(NULL);
+		}
+
+		// Announce that this CPU is about to halt, then look at
+		// the run queues once more: anything queued from now on
+		// comes with a wakeup IPI.
+		xchg(&thiscpu->cpu_halted, 1);
+	}
 }
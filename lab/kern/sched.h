@@ -6,7 +6,19 @@
 # error "This is a JOS kernel header; user programs should not #include it"
 #endif
 
+#include <inc/env.h>
+
 // This function does not return.
 void sched_yield(void) __attribute__((noreturn));
 
+void sched_init(void);
+void sched_enqueue(struct Env *e);
+void sched_dequeue(struct Env *e);
+void sched_set_affinity(struct Env *e, int cpu);
+void sched_set_priority(struct Env *e, int prio);
+bool sched_tick(void);
+void sched_stop(struct Env *e);
+void sched_block(void) __attribute__((noreturn));
+void sched_handoff(struct Env *e) __attribute__((noreturn));
+
 #endif	// !JOS_KERN_SCHED_H
@@ -14,8 +14,45 @@
 #include <kern/time.h>
 #include <kern/pci.h>
 #include <kern/e1000.h>
+#include <kern/spinlock.h>
 
-#define PTE_COW		0x800
+static int page_map_locked(struct Env *srcenv, void *srcva,
+			   struct Env *dstenv, void *dstva, int perm);
+static int ipc_deliver(struct Env *src, struct Env *target_env,
+		       uint32_t value, const uint32_t *regs,
+		       const struct IpcPages *pg);
+static int ipc_send_locked(struct Env *target_env, uint32_t value,
+			   const uint32_t *regs, const struct IpcPages *pg);
+static int ipc_recv_locked(void *dstva, uint32_t npages);
+static int ipc_pages_one(struct IpcPages *pg, void *srcva, unsigned perm);
+static int ipc_window_check(void *dstva, unsigned npages);
+static int ipc_send_wait(envid_t envid, uint32_t value, const uint32_t *regs,
+			 const struct IpcPages *pg, unsigned timeout);
+static int ipc_send_recv(envid_t envid, uint32_t value, const uint32_t *regs,
+			 const struct IpcPages *pg, void *dstva,
+			 unsigned dstpages);
+static int notify_post(envid_t envid, uint32_t bits);
+static void notify_timeouts(uint32_t now);
+
+// Senders blocked in sys_ipc_send wait in FIFO order on the send
+// queue of the env they send to.  ipc_sendq_lock protects all send
+// queues and every env's env_ipc_sendq_on; it nests inside env locks.
+// Taking a sender off a queue to wake it also takes the sender's lock.
+static struct spinlock ipc_sendq_lock;
+// Senders whose receiver was freed, to be woken by ipc_tick
+static struct IpcSendq ipc_orphans;
+// Earliest deadline of a queued sender, or 0 if none has one
+static uint32_t ipc_next_deadline;
+
+// notify_lock protects every env's notification fields and the list
+// of envs to wake; it nests inside env locks.  An env also holds its
+// own lock to start waiting, and so does whoever wakes it.
+static struct spinlock notify_lock;
+// Envs that got a signal they are waiting for, to be woken by
+// notify_flush
+static struct Env *notify_wakeq;
+// Earliest deadline of an env in sys_wait_notify, or 0 if none
+static uint32_t notify_next_deadline;
 
 // Print a string to the system console.
 // The string is exactly 'len' characters long.
@@ -68,9 +105,11 @@ sys_env_destroy(envid_t envid)
 	int r;
 	struct Env *e;
 
-	if ((r = envid2env(envid, &e, 1)) < 0)
+	// Look e up under its lock, so that it cannot be freed and its
+	// slot reused by another env before we destroy it.
+	if ((r = envid2env_lock(envid, &e, 1)) < 0)
 		return r;
-	env_destroy(e);
+	env_destroy_locked(e);
 	return 0;
 }
 
@@ -78,6 +117,7 @@ sys_env_destroy(envid_t envid)
 static void
 sys_yield(void)
 {
+	curenv->env_vol_switches++;
 	sched_yield();
 }
 
@@ -106,13 +146,48 @@ sys_exofork(void)
 		panic("unknow error code %d",r);
 	}
 	
-	env->env_status = ENV_NOT_RUNNABLE;
+	// env_alloc leaves the new env ENV_NOT_RUNNABLE.
+	env_lock(env);
 	env->env_tf = curenv->env_tf;
 	env->env_tf.tf_regs.reg_eax = 0;
+	env_unlock(env);
 	
 	return env->env_id;
 }
 
+// Create a copy of the current environment, as fork does, and make it
+// runnable.  The user address space is shared copy-on-write (see
+// pgdir_fork), and later write faults on it are resolved by the kernel.
+// The child returns 0 from this call and inherits the page fault upcall.
+// Returns envid of the child, or < 0 on error.  Errors are:
+//	-E_NO_FREE_ENV if no free environment is available.
+//	-E_NO_MEM on memory exhaustion.
+static envid_t
+sys_fork(void)
+{
+	int r;
+	struct Env *env;
+
+	if ((r = env_alloc(&env, curenv->env_id)) < 0)
+		return r;
+
+	env_lock_pair(curenv, env);
+	env->env_tf = curenv->env_tf;
+	env->env_tf.tf_regs.reg_eax = 0;
+	env->env_pgfault_upcall = curenv->env_pgfault_upcall;
+	r = pgdir_fork(env->env_pgdir, curenv->env_pgdir);
+	// pgdir_fork write-protected our writable pages.
+	tlb_flush(curenv->env_pgdir);
+	if (r < 0) {
+		env_unlock_pair(curenv, env);
+		env_destroy(env);
+		return r;
+	}
+	sched_enqueue(env);
+	env_unlock_pair(curenv, env);
+	return env->env_id;
+}
+
 // Set envid's env_status to status, which must be ENV_RUNNABLE
 // or ENV_NOT_RUNNABLE.
 //
@@ -134,10 +209,20 @@ sys_env_set_status(envid_t envid, int status)
 		return -E_INVAL;
 		
 	struct Env *env = NULL;
-	if (envid2env(envid, &env, 1) < 0)
+	if (envid2env_lock(envid, &env, 1) < 0)
 		return -E_BAD_ENV;
 	
-	env->env_status = status;
+	// Only an env that isn't running can be put on (or taken off)
+	// a run queue; a running env's status is its CPU's business.
+	if (env->env_status == ENV_RUNNABLE || env->env_status == ENV_NOT_RUNNABLE) {
+		if (status == ENV_RUNNABLE)
+			sched_enqueue(env);
+		else {
+			sched_dequeue(env);
+			env->env_status = status;
+		}
+	}
+	env_unlock(env);
 	return 0;
 }
 
@@ -155,10 +240,9 @@ sys_env_set_trapframe(envid_t envid, struct Trapframe *tf)
 	// Remember to check whether the user has supplied us with a good
 	// address!
 	struct Env *env = NULL;
-	if (envid2env(envid, &env, 1) < 0)
-		return -E_BAD_ENV;
-		
-	user_mem_assert(env, tf, sizeof(struct Trapframe), PTE_U | PTE_P | PTE_W);
+	
+	// tf lives in the caller's address space.
+	user_mem_assert(curenv, tf, sizeof(struct Trapframe), PTE_U | PTE_P | PTE_W);
 	//check the contents of tf
 	if ((tf->tf_cs & 3) != 3) {
 		cprintf("sys_env_set_trapframe: tf->tf_cs & 3 != 3\n");
@@ -170,7 +254,13 @@ sys_env_set_trapframe(envid_t envid, struct Trapframe *tf)
 		return -E_INVAL;
 	}
 	
+	if (envid2env_lock(envid, &env, 1) < 0)
+		return -E_BAD_ENV;
 	env->env_tf = *tf;
+	// Restore every register on return, as iret does; sysexit
+	// would clobber %ecx and %edx.
+	env->env_tf.tf_trapno = T_SYSCALL;
+	env_unlock(env);
 	return 0;
 }
 
@@ -227,8 +317,6 @@ sys_page_alloc(envid_t envid, void *va, int perm)
 	// LAB 4: Your code here.
 	//cprintf("sys_page_alloc: perm = %08x\n", perm);
 	struct Env *env = NULL;
-	if (envid2env(envid, &env, 1) < 0)
-		return -E_BAD_ENV;
 	
 	uintptr_t va_alias = (uintptr_t)va;
 	if (va_alias >= UTOP || va_alias % PGSIZE )
@@ -241,16 +329,74 @@ sys_page_alloc(envid_t envid, void *va, int perm)
 	if (!(pp = page_alloc(ALLOC_ZERO)))
 		return -E_NO_MEM;
 	
+	if (envid2env_lock(envid, &env, 1) < 0) {
+		page_free(pp);
+		return -E_BAD_ENV;
+	}
+	
 	struct Page *mapped_pp = NULL;
 	mapped_pp = page_lookup(env->env_pgdir, va, 0);
-	if (mapped_pp)
-		page_remove(env->env_pgdir,va);
+	if (mapped_pp && page_remove(env->env_pgdir,va) < 0) {
+		env_unlock(env);
+		page_free(pp);
+		return -E_NO_MEM;
+	}
 	
-	if (page_insert(env->env_pgdir, pp, va, perm) < 0)
+	if (page_insert(env->env_pgdir, pp, va, perm) < 0) {
+		env_unlock(env);
+		page_free(pp);
 		return -E_NO_MEM;
+	}
 	
+	env_unlock(env);
 	return 0;
 }
+
+// Allocate a zeroed 4MB superpage and map it at 'va' in the address
+// space of 'envid', with permission 'perm', using one page directory
+// entry and one TLB entry for the whole region.  'va' must be 4MB
+// aligned, and no 4KB pages may be mapped in [va, va+PTSIZE).
+// fork makes a writable superpage copy-on-write, and the first write
+// after it copies all 4MB; with PTE_SHARE it is shared instead.
+// Unmapping any page in it unmaps all of it.
+//
+// perm -- as for sys_page_alloc, except that PTE_COW may not be set.
+//
+// Return 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if va >= UTOP, or va is not 4MB-aligned, or va is in
+//		the 4MB region holding the user stacks.
+//	-E_INVAL if perm is inappropriate (see above).
+//	-E_INVAL if 4KB pages are mapped in [va, va+PTSIZE).
+//	-E_NO_MEM if there are no 4MB of contiguous free memory.
+static int
+sys_superpage_alloc(envid_t envid, void *va, int perm)
+{
+	struct Env *env;
+	struct Page *pp;
+	int r;
+
+	if ((uintptr_t) va >= UTOP || (uintptr_t) va % PTSIZE
+	    || PDX(va) == PDX(UXSTACKTOP - PGSIZE))
+		return -E_INVAL;
+	if ((perm & ~PTE_SYSCALL) || (perm & PTE_COW)
+	    || !(perm & PTE_U) || !(perm & PTE_P))
+		return -E_INVAL;
+
+	if (!(pp = page_alloc_order(PAGE_MAX_ORDER, ALLOC_ZERO)))
+		return -E_NO_MEM;
+	if ((r = envid2env_lock(envid, &env, 1)) < 0) {
+		page_free_order(pp, PAGE_MAX_ORDER);
+		return r;
+	}
+	r = superpage_insert(env->env_pgdir, pp, va, perm);
+	env_unlock(env);
+	if (r < 0)
+		page_free_order(pp, PAGE_MAX_ORDER);
+	return r;
+}
+
 void user_page_fault_handler(struct Trapframe *tf, uintptr_t fault_va);
 // Map the page of memory at 'srcva' in srcenvid's address space
 // at 'dstva' in dstenvid's address space with permission 'perm'.
@@ -264,6 +410,7 @@ void user_page_fault_handler(struct Trapframe *tf, uintptr_t fault_va);
 //	-E_INVAL if srcva >= UTOP or srcva is not page-aligned,
 //		or dstva >= UTOP or dstva is not page-aligned.
 //	-E_INVAL is srcva is not mapped in srcenvid's address space.
+//	-E_INVAL if srcva is in a superpage.
 //	-E_INVAL if perm is inappropriate (see sys_page_alloc).
 //	-E_INVAL if (perm & PTE_W), but srcva is read-only in srcenvid's
 //		address space.
@@ -283,28 +430,45 @@ sys_page_map(envid_t srcenvid, void *srcva,
 
 	// LAB 4: Your code here.
 	struct Env *srcenv = NULL, *dstenv = NULL;
-	if (envid2env(srcenvid, &srcenv, 1) < 0
-			|| envid2env(dstenvid, &dstenv, 1) < 0)
-		return -E_BAD_ENV;
+	int r;
 	
 	if ((uint32_t)srcva >= UTOP || (uint32_t)srcva % PGSIZE
 		 || (uint32_t)dstva >= UTOP || (uint32_t)dstva % PGSIZE) {
 		cprintf("invalid paramters0\n");
 		return -E_INVAL;
 	}
-		
+	
+	if ((perm & ~PTE_SYSCALL) || !(perm & PTE_U) || !(perm & PTE_P)) {
+		cprintf("invalid paramters2, perm = %08x\n", perm);
+		return -E_INVAL;
+	}
+	
+	if ((r = envid2env_lock_pair(srcenvid, &srcenv, dstenvid, &dstenv, 1)) < 0)
+		return r;
+	r = page_map_locked(srcenv, srcva, dstenv, dstva, perm);
+	env_unlock_pair(srcenv, dstenv);
+	return r;
+}
+
+// Helper for sys_page_map, called with both envs' locks held.
+static int
+page_map_locked(struct Env *srcenv, void *srcva,
+		struct Env *dstenv, void *dstva, int perm)
+{
 	pte_t *ptep = NULL;
 	struct Page *srcpage = NULL;
+	// A shared page table (see pgdir_fork) maps its pages read-only
+	// whatever its entries say; unshare it to get the real permissions.
+	if ((perm & PTE_W) && pgtable_unshare(srcenv->env_pgdir, srcva) < 0)
+		return -E_NO_MEM;
 	srcpage = page_lookup(srcenv->env_pgdir, srcva, &ptep);
 	if (!ptep || !*ptep || !srcpage) {
 		cprintf("invalid paramters1\n");
 		return -E_INVAL;
 	}
-	
-	if ((perm & ~PTE_SYSCALL) || !(perm & PTE_U) || !(perm & PTE_P)) {
-		cprintf("invalid paramters2, perm = %08x\n", perm);
+	// Only a whole superpage has a reference count.
+	if (*ptep & PTE_PS)
 		return -E_INVAL;
-	}
 	
 		
 	if((perm & PTE_W) && !(*ptep & PTE_W)) {
@@ -333,6 +497,8 @@ sys_page_map(envid_t srcenvid, void *srcva,
 //	-E_BAD_ENV if environment envid doesn't currently exist,
 //		or the caller doesn't have permission to change envid.
 //	-E_INVAL if va >= UTOP, or va is not page-aligned.
+//	-E_NO_MEM if the page table mapping va is shared (see
+//		pgtable_unshare) and there's no memory to copy it.
 static int
 sys_page_unmap(envid_t envid, void *va)
 {
@@ -340,14 +506,16 @@ sys_page_unmap(envid_t envid, void *va)
 
 	// LAB 4: Your code here.
 	struct Env *env = NULL;
-	if (envid2env(envid, &env, 1) < 0)
-		return -E_BAD_ENV;
+	int r;
 	if ((uintptr_t)va >= UTOP || (uintptr_t)va % PGSIZE) {
 		return -E_INVAL;
 	}
+	if (envid2env_lock(envid, &env, 1) < 0)
+		return -E_BAD_ENV;
 	
-	page_remove(env->env_pgdir, va);
-	return 0;
+	r = page_remove(env->env_pgdir, va);
+	env_unlock(env);
+	return r;
 }
 
 // Try to send 'value' to the target env 'envid'.
@@ -383,7 +551,7 @@ sys_page_unmap(envid_t envid, void *va)
 //	-E_INVAL if srcva < UTOP and perm is inappropriate
 //		(see sys_page_alloc).
 //	-E_INVAL if srcva < UTOP but srcva is not mapped in the caller's
-//		address space.
+//		address space, or is in a superpage.
 //	-E_INVAL if (perm & PTE_W), but srcva is read-only in the
 //		current environment's address space.
 //	-E_NO_MEM if there's not enough memory to map srcva in envid's
@@ -392,67 +560,514 @@ static int
 sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 {
 	// LAB 4: Your code here.
-	struct Env *target_env;
-	if (envid2env(envid, &target_env, 0) < 0) {
+	struct Env *self, *target_env;
+	struct IpcPages pg;
+	int r;
+	
+	if ((r = ipc_pages_one(&pg, srcva, perm)) < 0) {
+		cprintf("sys_ipc_try_send: bad parameters, srcva = %08x, perm = %08x\n",
+			srcva, perm);
+		return r;
+	}
+	
+	// Lock ourselves too: the page lookup below reads our page tables.
+	if (envid2env_lock_pair(0, &self, envid, &target_env, 0) < 0) {
 		cprintf("sys_ipc_try_send: env[%08x] doesn't exist\n", envid);
 		return -E_BAD_ENV;
 	}
-		
-	if (target_env->env_status != ENV_NOT_RUNNABLE && !target_env->env_ipc_recving) {
-		//cprintf("sys_ipc_try_send: env[%08x] isn't waiting for message", envid);
-		return -E_IPC_NOT_RECV;
-	}
-	
-	if ((uintptr_t)srcva < UTOP && (uintptr_t)srcva % PGSIZE) {
-		cprintf("sys_ipc_try_send: bad parameter, srcva = %08x\n", srcva);
+	r = ipc_send_locked(target_env, value, NULL, &pg);
+	env_unlock_pair(self, target_env);
+	return r;
+}
+
+// Check the pages and permissions of a message.
+// Returns 0 on success, -E_INVAL if there are too many pages, a page
+// is not page-aligned or not below UTOP, or ip_perm is inappropriate
+// (see sys_page_alloc).
+static int
+ipc_pages_check(const struct IpcPages *pg)
+{
+	uint32_t i;
+
+	if (pg->ip_npages > IPC_MAXPAGES)
 		return -E_INVAL;
-	}
-		
-	if ((uintptr_t)srcva < UTOP &&
-		((perm & ~PTE_SYSCALL) || !(perm & PTE_U) || !(perm & PTE_P))) {
-		cprintf("sys_ipc_try_send: bad parameters, perm = %08x\n", perm);
+	if (pg->ip_npages && ((pg->ip_perm & ~PTE_SYSCALL)
+			      || !(pg->ip_perm & PTE_U)
+			      || !(pg->ip_perm & PTE_P)))
 		return -E_INVAL;
+	for (i = 0; i < pg->ip_npages; i++)
+		if ((uintptr_t) pg->ip_va[i] >= UTOP
+		    || (uintptr_t) pg->ip_va[i] % PGSIZE)
+			return -E_INVAL;
+	return 0;
+}
+
+// Make 'pg' describe the page at 'srcva' with 'perm', as passed to the
+// single-page IPC system calls, or no page if srcva >= UTOP.
+static int
+ipc_pages_one(struct IpcPages *pg, void *srcva, unsigned perm)
+{
+	pg->ip_npages = (uintptr_t) srcva < UTOP;
+	pg->ip_perm = perm;
+	pg->ip_va[0] = srcva;
+	return ipc_pages_check(pg);
+}
+
+// Copy the message pages that user pointer 'upg' describes into 'pg',
+// or no pages if upg is NULL, and check them.
+// Destroys the environment if upg isn't readable.
+static int
+ipc_pages_copyin(struct IpcPages *pg, const struct IpcPages *upg)
+{
+	if (!upg) {
+		pg->ip_npages = 0;
+		return 0;
 	}
-		
-	struct Page *pp = NULL;
-	pte_t *ptep = NULL;
-	if ((uintptr_t)srcva < UTOP && !(pp = page_lookup(curenv->env_pgdir, 
-														srcva, &ptep))) {
-		cprintf("sys_ipc_try_send: bad parameter, no mapping in srcva = %08x\n", 
-				srcva);
-		return -E_INVAL;
+	user_mem_assert(curenv, upg, sizeof(*upg), PTE_U);
+	*pg = *upg;
+	return ipc_pages_check(pg);
+}
+
+// Look up the pages of pg in src's address space, which the caller
+// has locked, and store them in 'pps'.  A copy-on-write page sent
+// with PTE_W gets its own copy first, as a write fault would.
+// Returns 0 on success, -E_INVAL if a page isn't mapped, is in a
+// superpage, or is read-only but sent with PTE_W, or -E_NO_MEM.
+static int
+ipc_pages_lookup(struct Env *src, const struct IpcPages *pg,
+		 struct Page **pps)
+{
+	pte_t *ptep;
+	uint32_t i;
+	int r;
+
+	for (i = 0; i < pg->ip_npages; i++) {
+		// See page_map_locked.
+		if ((pg->ip_perm & PTE_W)
+		    && pgtable_unshare(src->env_pgdir, pg->ip_va[i]) < 0)
+			return -E_NO_MEM;
+		if (!(pps[i] = page_lookup(src->env_pgdir, pg->ip_va[i], &ptep))
+		    || (*ptep & PTE_PS))
+			return -E_INVAL;
+		if ((pg->ip_perm & PTE_W) && !(*ptep & PTE_W)) {
+			if (!(*ptep & PTE_COW))
+				return -E_INVAL;
+			if ((r = page_cow(src->env_pgdir, pg->ip_va[i])) < 0)
+				return r;
+			pps[i] = page_lookup(src->env_pgdir, pg->ip_va[i], NULL);
+		}
 	}
-	
-	
-	
-	if (    (uintptr_t)srcva < UTOP 
-	     && (perm & PTE_W) 
-	     && !(*ptep & PTE_W)) {
-		cprintf("sys_ipc_try_send: bad parameters, perm with PTE_W, but \
-				 pte with srcva can't PTE_W, perm = %08x, pte = %08x\n", perm, *ptep);
-		return -E_INVAL;
+	return 0;
+}
+
+// Helper for sys_ipc_try_send, called with the locks of both
+// curenv and target_env held.
+static int
+ipc_send_locked(struct Env *target_env, uint32_t value, const uint32_t *regs,
+		const struct IpcPages *pg)
+{
+	int r;
+
+	if ((r = ipc_deliver(curenv, target_env, value, regs, pg)) < 0)
+		return r;
+	sched_enqueue(target_env);
+	return 0;
+}
+
+// Hand src's message to target_env, which must be waiting in
+// sys_ipc_recv, but leave it ENV_NOT_RUNNABLE: the caller decides
+// where it runs next.  Called with the locks of both src and
+// target_env held.
+//
+// The message's pages are mapped one after another at the receiver's
+// env_ipc_dstva, as many as its window of env_ipc_dstpages holds.  A
+// receiver with a window of more than one page gets the rest of it
+// unmapped, so the window holds exactly this message's pages.
+//
+// The IPC_NREGS words at 'regs', or zeros if regs is NULL, go to the
+// receiver's env_ipc_regs along with value.
+static int
+ipc_deliver(struct Env *src, struct Env *target_env, uint32_t value,
+	    const uint32_t *regs, const struct IpcPages *pg)
+{
+	struct Page *pps[IPC_MAXPAGES];
+	uint32_t i, n;
+	char *dstva;
+	int r;
+
+	if (!target_env->env_ipc_recving) {
+		//cprintf("sys_ipc_try_send: env[%08x] isn't waiting for message", envid);
+		return -E_IPC_NOT_RECV;
+	}
+		
+	if ((r = ipc_pages_lookup(src, pg, pps)) < 0) {
+		cprintf("sys_ipc_try_send: bad pages from env[%08x]: %e\n",
+			src->env_id, r);
+		return r;
 	}
 		
 	target_env->env_ipc_recving = 0;
-	target_env->env_ipc_from = curenv->env_id;
+	target_env->env_ipc_from = src->env_id;
 	target_env->env_ipc_value = value;
+	if (regs)
+		memmove(target_env->env_ipc_regs, regs,
+			sizeof(target_env->env_ipc_regs));
+	else
+		memset(target_env->env_ipc_regs, 0,
+		       sizeof(target_env->env_ipc_regs));
 	target_env->env_ipc_perm = 0;
+	target_env->env_ipc_npages = 0;
 	
-	if ((uintptr_t)srcva < UTOP && (uintptr_t)target_env->env_ipc_dstva < UTOP) {
-		int r;
-		if ((r = page_insert(target_env->env_pgdir, pp, target_env->env_ipc_dstva, perm)) < 0) {
+	dstva = target_env->env_ipc_dstva;
+	n = MIN(pg->ip_npages, target_env->env_ipc_dstpages);
+	for (i = 0; i < n; i++)
+		if ((r = page_insert(target_env->env_pgdir, pps[i],
+				     dstva + i * PGSIZE, pg->ip_perm)) < 0) {
 			cprintf("sys_ipc_try_send: %e\n",r);
 			return -E_NO_MEM;
 		}
-		target_env->env_ipc_perm = perm;
+	if (target_env->env_ipc_dstpages > 1)
+		for (i = n; i < target_env->env_ipc_dstpages; i++)
+			if (page_remove(target_env->env_pgdir,
+					dstva + i * PGSIZE) < 0)
+				return -E_NO_MEM;
+	if (n) {
+		target_env->env_ipc_perm = pg->ip_perm;
+		target_env->env_ipc_npages = n;
 	}
 	
 	target_env->env_tf.tf_regs.reg_eax = 0;
-	target_env->env_status = ENV_RUNNABLE;
-	
 	return 0;
 }
 
+void
+ipc_init(void)
+{
+	spin_initlock(&ipc_sendq_lock);
+	spin_initlock(&notify_lock);
+}
+
+// Append e to q.  The caller holds ipc_sendq_lock.
+static void
+sendq_push(struct IpcSendq *q, struct Env *e)
+{
+	e->env_ipc_sq_next = NULL;
+	e->env_ipc_sq_prev = q->sq_tail;
+	if (q->sq_tail)
+		q->sq_tail->env_ipc_sq_next = e;
+	else
+		q->sq_head = e;
+	q->sq_tail = e;
+	e->env_ipc_sendq_on = q;
+}
+
+// Take e off the queue it is on.  The caller holds ipc_sendq_lock.
+static void
+sendq_remove(struct Env *e)
+{
+	struct IpcSendq *q = e->env_ipc_sendq_on;
+
+	if (e->env_ipc_sq_prev)
+		e->env_ipc_sq_prev->env_ipc_sq_next = e->env_ipc_sq_next;
+	else
+		q->sq_head = e->env_ipc_sq_next;
+	if (e->env_ipc_sq_next)
+		e->env_ipc_sq_next->env_ipc_sq_prev = e->env_ipc_sq_prev;
+	else
+		q->sq_tail = e->env_ipc_sq_prev;
+	e->env_ipc_sq_next = e->env_ipc_sq_prev = NULL;
+	e->env_ipc_sendq_on = NULL;
+}
+
+// Has 'deadline' (in time_msec units) passed at 'now'?
+static bool
+deadline_passed(uint32_t deadline, uint32_t now)
+{
+	return (int32_t) (deadline - now) <= 0;
+}
+
+// Send 'value' (and the page at 'srcva' with 'perm') to 'envid' as
+// sys_ipc_try_send does, but if envid is not waiting to receive,
+// block on its send queue until it calls sys_ipc_recv, for at most
+// 'timeout' milliseconds.  A timeout of IPC_NOWAIT doesn't block at
+// all; IPC_FOREVER waits as long as it takes.  Senders are served
+// first come, first served.
+//
+// Returns 0 on success, < 0 on error.  Errors are those of
+// sys_ipc_try_send, and:
+//	-E_IPC_NOT_RECV if the timeout expired first.
+//	-E_BAD_ENV if envid exited first.
+static int
+sys_ipc_send(envid_t envid, uint32_t value, void *srcva, unsigned perm,
+	     unsigned timeout)
+{
+	struct IpcPages pg;
+	int r;
+
+	if ((r = ipc_pages_one(&pg, srcva, perm)) < 0)
+		return r;
+	return ipc_send_wait(envid, value, NULL, &pg, timeout);
+}
+
+// Send 'value' and the pages that 'pg' describes to 'envid', as
+// sys_ipc_send does.  The receiver gets the pages mapped one after
+// another in its receive window (see sys_ipc_recvv), up to the
+// window's size; it finds how many in env_ipc_npages.
+//
+// Errors are those of sys_ipc_send, and -E_INVAL if pg has more than
+// IPC_MAXPAGES pages.
+static int
+sys_ipc_sendv(envid_t envid, uint32_t value, const struct IpcPages *upg,
+	      unsigned timeout)
+{
+	struct IpcPages pg;
+	int r;
+
+	if ((r = ipc_pages_copyin(&pg, upg)) < 0)
+		return r;
+	return ipc_send_wait(envid, value, NULL, &pg, timeout);
+}
+
+// Helper for the blocking sends, with pg already checked.
+static int
+ipc_send_wait(envid_t envid, uint32_t value, const uint32_t *regs,
+	      const struct IpcPages *pg, unsigned timeout)
+{
+	struct Env *self, *target_env;
+	struct Page *pps[IPC_MAXPAGES];
+	int r;
+
+	if (envid2env_lock_pair(0, &self, envid, &target_env, 0) < 0)
+		return -E_BAD_ENV;
+	r = ipc_send_locked(target_env, value, regs, pg);
+	if (r != -E_IPC_NOT_RECV || timeout == IPC_NOWAIT
+	    || target_env == self) {
+		env_unlock_pair(self, target_env);
+		return r;
+	}
+
+	// Catch bad pages now rather than when the receiver gets to us.
+	if ((r = ipc_pages_lookup(self, pg, pps)) < 0) {
+		env_unlock_pair(self, target_env);
+		return r;
+	}
+
+	self->env_ipc_send_value = value;
+	if (regs)
+		memmove(self->env_ipc_send_regs, regs,
+			sizeof(self->env_ipc_send_regs));
+	else
+		memset(self->env_ipc_send_regs, 0,
+		       sizeof(self->env_ipc_send_regs));
+	self->env_ipc_send_pages = *pg;
+	self->env_ipc_send_deadline = 0;
+	spin_lock(&ipc_sendq_lock);
+	if (timeout != IPC_FOREVER) {
+		// 0 means no deadline, so never use it as one.
+		self->env_ipc_send_deadline = (time_msec() + timeout) | 1;
+		if (!ipc_next_deadline || deadline_passed(
+			    self->env_ipc_send_deadline, ipc_next_deadline))
+			ipc_next_deadline = self->env_ipc_send_deadline;
+	}
+	sendq_push(&target_env->env_ipc_sendq, self);
+	spin_unlock(&ipc_sendq_lock);
+	env_unlock(target_env);
+
+	// Whoever takes us off the queue sets our return value.
+	sched_block();	// not return
+}
+
+// Wake e, which was blocked in sys_ipc_send on queue 'q', with return
+// value 'r', unless it has left q already.  The caller holds no env
+// locks.
+static void
+ipc_send_wake(struct Env *e, struct IpcSendq *q, int r)
+{
+	bool queued;
+
+	env_lock(e);
+	spin_lock(&ipc_sendq_lock);
+	if ((queued = (e->env_ipc_sendq_on == q)))
+		sendq_remove(e);
+	spin_unlock(&ipc_sendq_lock);
+	if (queued) {
+		e->env_tf.tf_regs.reg_eax = r;
+		sched_enqueue(e);
+	}
+	env_unlock(e);
+}
+
+// Called on every timer tick on one CPU: fail the sends whose timeout
+// expired or whose receiver is gone.
+void
+ipc_tick(void)
+{
+	struct Env *e;
+	struct IpcSendq *q;
+	uint32_t now = time_msec();
+	int i;
+
+	while ((e = ipc_orphans.sq_head))
+		ipc_send_wake(e, &ipc_orphans, -E_BAD_ENV);
+	notify_flush();
+	notify_timeouts(now);
+
+	if (!ipc_next_deadline || !deadline_passed(ipc_next_deadline, now))
+		return;
+
+	// Timeouts are rare; just look at every env, and find the next
+	// deadline on the way.  Senders that queue meanwhile lower
+	// ipc_next_deadline themselves.
+	spin_lock(&ipc_sendq_lock);
+	ipc_next_deadline = 0;
+	spin_unlock(&ipc_sendq_lock);
+	for (i = 0; i < NENV; i++) {
+		e = &envs[i];
+		spin_lock(&ipc_sendq_lock);
+		q = NULL;
+		if (e->env_ipc_sendq_on && e->env_ipc_send_deadline) {
+			if (deadline_passed(e->env_ipc_send_deadline, now))
+				q = e->env_ipc_sendq_on;
+			else if (!ipc_next_deadline || deadline_passed(
+				    e->env_ipc_send_deadline, ipc_next_deadline))
+				ipc_next_deadline = e->env_ipc_send_deadline;
+		}
+		spin_unlock(&ipc_sendq_lock);
+		if (q)
+			ipc_send_wake(e, q, -E_IPC_NOT_RECV);
+	}
+}
+
+// Does ipc_tick still have work to do: a send or a sys_wait_notify to
+// time out, a send to fail because its receiver is gone, or a notified
+// env to wake?  If so, the system is not idle for good even if nothing
+// is runnable.
+bool
+ipc_timeouts_pending(void)
+{
+	return ipc_next_deadline || ipc_orphans.sq_head
+	    || notify_next_deadline || notify_wakeq;
+}
+
+// e is being freed: take it off the send queue it waits on, and hand
+// the senders waiting on it to ipc_tick, which fails their sends.
+// (Waking them here would take their locks while holding e's.)
+// Post NOTIFY_CHILD to e's parent, which is woken the same way.
+// The caller holds e's lock.
+void
+ipc_env_free(struct Env *e)
+{
+	struct Env *s, **sp;
+
+	spin_lock(&ipc_sendq_lock);
+	if (e->env_ipc_sendq_on)
+		sendq_remove(e);
+	while ((s = e->env_ipc_sendq.sq_head)) {
+		sendq_remove(s);
+		sendq_push(&ipc_orphans, s);
+	}
+	spin_unlock(&ipc_sendq_lock);
+
+	// Tell the parent, and forget e's own signals.
+	notify_post(e->env_parent_id, NOTIFY_CHILD);
+	spin_lock(&notify_lock);
+	if (e->env_notify_queued) {
+		for (sp = &notify_wakeq; *sp != e; sp = &(*sp)->env_notify_next)
+			/* nothing */;
+		*sp = e->env_notify_next;
+	}
+	e->env_notify_queued = 0;
+	e->env_notify_pending = 0;
+	e->env_notify_waiting = 0;
+	e->env_notify_mask = 0;
+	e->env_notify_deadline = 0;
+	spin_unlock(&notify_lock);
+}
+
+// Send 'value' and the pages that 'pg' describes (none if pg is NULL)
+// to 'envid', as sys_ipc_sendv does without waiting, then block
+// waiting for a message into a window of 'dstpages' pages at 'dstva',
+// as sys_ipc_recvv does, in one trap.  This is an RPC call, or a
+// server's reply to one client and wait for the next request.  The
+// receiver runs right away on this CPU for the rest of our time
+// slice, without going through the run queues (see sched_handoff).
+//
+// Returns 0 if the message was sent and a queued sender's message
+// was received right away, and otherwise only on error, without
+// having sent anything.  Errors are those of sys_ipc_sendv and
+// sys_ipc_recvv.
+static int
+sys_ipc_send_recv(envid_t envid, uint32_t value, const struct IpcPages *upg,
+		  void *dstva, unsigned dstpages)
+{
+	struct IpcPages pg;
+	int r;
+
+	if ((r = ipc_pages_copyin(&pg, upg)) < 0)
+		return r;
+	if ((r = ipc_window_check(dstva, dstpages)) < 0)
+		return r;
+	return ipc_send_recv(envid, value, NULL, &pg, dstva, dstpages);
+}
+
+// Send 'value' and the IPC_NREGS words w1..w3 to 'envid' and wait for
+// it to receive them, as sys_ipc_send does with IPC_FOREVER.  No page
+// goes with the message: the receiver finds the words in its
+// env_ipc_regs, next to env_ipc_value.
+static int
+sys_ipc_send_regs(envid_t envid, uint32_t value, uint32_t w1, uint32_t w2,
+		  uint32_t w3)
+{
+	struct IpcPages pg;
+	uint32_t regs[IPC_NREGS] = { w1, w2, w3 };
+
+	pg.ip_npages = 0;
+	return ipc_send_wait(envid, value, regs, &pg, IPC_FOREVER);
+}
+
+// sys_ipc_send_recv for a message of 'value' and the words w1..w3, as
+// sys_ipc_send_regs sends, with no receive window: a small RPC that
+// maps no pages either way.  The answer's value and words arrive in
+// env_ipc_value and env_ipc_regs.
+static int
+sys_ipc_call_regs(envid_t envid, uint32_t value, uint32_t w1, uint32_t w2,
+		  uint32_t w3)
+{
+	struct IpcPages pg;
+	uint32_t regs[IPC_NREGS] = { w1, w2, w3 };
+
+	pg.ip_npages = 0;
+	return ipc_send_recv(envid, value, regs, &pg, (void *) UTOP, 0);
+}
+
+// Helper for sys_ipc_send_recv and sys_ipc_call_regs, with pg and the
+// receive window already checked.
+static int
+ipc_send_recv(envid_t envid, uint32_t value, const uint32_t *regs,
+	      const struct IpcPages *pg, void *dstva, unsigned dstpages)
+{
+	struct Env *self, *target_env;
+	int r;
+
+	if (envid2env_lock_pair(0, &self, envid, &target_env, 0) < 0)
+		return -E_BAD_ENV;
+	if ((r = ipc_deliver(self, target_env, value, regs, pg)) < 0) {
+		env_unlock_pair(self, target_env);
+		return r;
+	}
+
+	// Senders queued on us come first.
+	if (self->env_ipc_sendq.sq_head) {
+		sched_enqueue(target_env);
+		env_unlock(target_env);
+		return ipc_recv_locked(dstva, dstpages);
+	}
+	self->env_ipc_recving = 1;
+	self->env_ipc_dstva = dstva;
+	self->env_ipc_dstpages = dstpages;
+	sched_handoff(target_env);	// not return
+}
+
 // Block until a value is ready.  Record that you want to receive
 // using the env_ipc_recving and env_ipc_dstva fields of struct Env,
 // mark yourself not runnable, and then give up the CPU.
@@ -471,16 +1086,243 @@ sys_ipc_recv(void *dstva)
 	if ((uintptr_t)dstva < UTOP && (uintptr_t)dstva % PGSIZE)
 		return -E_INVAL;
 	
+	env_lock(curenv);
+	return ipc_recv_locked(dstva, (uintptr_t)dstva < UTOP);
+}
+
+// Receive as sys_ipc_recv does, but with a window of 'npages' pages
+// at 'dstva' for the pages of a multi-page message (see
+// sys_ipc_sendv).  After the receive, the window holds just the
+// message's pages, and env_ipc_npages says how many there are; the
+// rest of the window is unmapped.
+//
+// Errors are:
+//	-E_INVAL if dstva is not page-aligned, or the window is larger
+//		than IPC_MAXPAGES or doesn't fit below UTOP.
+static int
+sys_ipc_recvv(void *dstva, unsigned npages)
+{
+	int r;
+
+	if ((r = ipc_window_check(dstva, npages)) < 0)
+		return r;
+	env_lock(curenv);
+	return ipc_recv_locked(dstva, npages);
+}
+
+// Check a receive window of 'npages' pages at 'dstva'.
+static int
+ipc_window_check(void *dstva, unsigned npages)
+{
+	if (npages > IPC_MAXPAGES || (uintptr_t)dstva % PGSIZE
+	    || (npages && ((uintptr_t)dstva >= UTOP
+			   || npages > (UTOP - (uintptr_t)dstva) / PGSIZE)))
+		return -E_INVAL;
+	return 0;
+}
+
+// Receive for the receive system calls, which hold curenv's lock; it
+// is released here.  Take the message of the first sender queued on
+// curenv, if any, and return 0 right away.  Otherwise block until a
+// message arrives.
+static int
+ipc_recv_locked(void *dstva, uint32_t npages)
+{
+	struct Env *self = curenv, *s;
+	int r;
+
+	self->env_ipc_dstva = dstva;
+	self->env_ipc_dstpages = npages;
+	while ((s = self->env_ipc_sendq.sq_head)) {
+		// Lock s too, in the proper order.  s may leave the
+		// queue meanwhile; then try the next one.
+		env_unlock(self);
+		env_lock_pair(self, s);
+		spin_lock(&ipc_sendq_lock);
+		if (s->env_ipc_sendq_on != &self->env_ipc_sendq) {
+			spin_unlock(&ipc_sendq_lock);
+			env_unlock(s);
+			continue;
+		}
+		sendq_remove(s);
+		spin_unlock(&ipc_sendq_lock);
+
+		self->env_ipc_recving = 1;
+		r = ipc_deliver(s, self, s->env_ipc_send_value,
+				s->env_ipc_send_regs, &s->env_ipc_send_pages);
+		self->env_ipc_recving = 0;
+		s->env_tf.tf_regs.reg_eax = r;
+		sched_enqueue(s);
+		env_unlock(s);
+		if (r == 0) {
+			env_unlock(self);
+			return 0;
+		}
+	}
+
 	//update env status for receive message
-	curenv->env_ipc_recving = 1;
-	curenv->env_ipc_dstva = dstva;
-	
-	curenv->env_status = ENV_NOT_RUNNABLE;
-	sched_yield();  //not return
-	
+	self->env_ipc_recving = 1;
+	sched_block();  //not return
+}
+
+// Post the signals 'bits' to 'envid', which may be waiting for them
+// in sys_wait_notify.  Signals already pending are not posted twice.
+// If envid waits for one of them, it goes on notify_wakeq; the caller
+// wakes it with notify_flush once it holds no env locks.
+// Returns 0 on success, -E_BAD_ENV if envid doesn't exist.
+static int
+notify_post(envid_t envid, uint32_t bits)
+{
+	struct Env *e = &envs[ENVX(envid)];
+
+	spin_lock(&notify_lock);
+	if (envid == 0 || e->env_status == ENV_FREE || e->env_id != envid) {
+		spin_unlock(&notify_lock);
+		return -E_BAD_ENV;
+	}
+	e->env_notify_pending |= bits;
+	if ((e->env_notify_pending & e->env_notify_mask)
+	    && !e->env_notify_queued) {
+		e->env_notify_next = notify_wakeq;
+		notify_wakeq = e;
+		e->env_notify_queued = 1;
+	}
+	spin_unlock(&notify_lock);
 	return 0;
 }
 
+// Wake e, blocked in sys_wait_notify, and have the call return 'bits',
+// which the caller has taken out of e's pending signals.  The caller
+// holds e's lock and notify_lock.
+static void
+notify_wake(struct Env *e, uint32_t bits)
+{
+	e->env_notify_waiting = 0;
+	e->env_notify_mask = 0;
+	e->env_notify_deadline = 0;
+	e->env_tf.tf_regs.reg_eax = bits;
+	sched_enqueue(e);
+}
+
+// Wake the envs on notify_wakeq that still wait for a signal they
+// got.  The caller holds no env locks.
+void
+notify_flush(void)
+{
+	struct Env *e;
+	uint32_t bits;
+
+	while (notify_wakeq) {
+		spin_lock(&notify_lock);
+		if (!(e = notify_wakeq)) {
+			spin_unlock(&notify_lock);
+			break;
+		}
+		notify_wakeq = e->env_notify_next;
+		e->env_notify_queued = 0;
+		spin_unlock(&notify_lock);
+
+		env_lock(e);
+		spin_lock(&notify_lock);
+		if (e->env_notify_waiting
+		    && (bits = e->env_notify_pending & e->env_notify_mask)) {
+			e->env_notify_pending &= ~bits;
+			notify_wake(e, bits);
+		}
+		spin_unlock(&notify_lock);
+		env_unlock(e);
+	}
+}
+
+// Wake the envs whose sys_wait_notify timed out at 'now', with no
+// signals.  Called from ipc_tick.
+static void
+notify_timeouts(uint32_t now)
+{
+	struct Env *e;
+	int i;
+
+	if (!notify_next_deadline || !deadline_passed(notify_next_deadline, now))
+		return;
+
+	// As for send timeouts in ipc_tick, look at every env.
+	spin_lock(&notify_lock);
+	notify_next_deadline = 0;
+	spin_unlock(&notify_lock);
+	for (i = 0; i < NENV; i++) {
+		e = &envs[i];
+		if (!e->env_notify_deadline)
+			continue;
+		env_lock(e);
+		spin_lock(&notify_lock);
+		if (e->env_notify_waiting && e->env_notify_deadline) {
+			if (deadline_passed(e->env_notify_deadline, now))
+				notify_wake(e, 0);
+			else if (!notify_next_deadline || deadline_passed(
+				    e->env_notify_deadline, notify_next_deadline))
+				notify_next_deadline = e->env_notify_deadline;
+		}
+		spin_unlock(&notify_lock);
+		env_unlock(e);
+	}
+}
+
+// Post the signals 'bits' to 'envid': set them in its pending signal
+// word, and wake it if it waits for one of them in sys_wait_notify.
+// Never blocks.  A signal posted again before envid takes it counts
+// once.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist.
+static int
+sys_notify(envid_t envid, uint32_t bits)
+{
+	int r;
+
+	if (envid == 0)
+		envid = curenv->env_id;
+	if ((r = notify_post(envid, bits)) < 0)
+		return r;
+	notify_flush();
+	return 0;
+}
+
+// Wait for one of the signals in 'mask' to be posted, for at most
+// 'timeout' milliseconds (IPC_NOWAIT or IPC_FOREVER as for
+// sys_ipc_send), then take all the pending signals in mask.  With a
+// mask of 0 this just sleeps for the timeout.
+//
+// Returns the signals taken, or 0 if the timeout expired first.
+static uint32_t
+sys_wait_notify(uint32_t mask, unsigned timeout)
+{
+	struct Env *self = curenv;
+	uint32_t bits;
+
+	env_lock(self);
+	spin_lock(&notify_lock);
+	if ((bits = self->env_notify_pending & mask) || timeout == IPC_NOWAIT) {
+		self->env_notify_pending &= ~bits;
+		spin_unlock(&notify_lock);
+		env_unlock(self);
+		return bits;
+	}
+	self->env_notify_waiting = 1;
+	self->env_notify_mask = mask;
+	self->env_notify_deadline = 0;
+	if (timeout != IPC_FOREVER) {
+		// 0 means no deadline, so never use it as one.
+		self->env_notify_deadline = (time_msec() + timeout) | 1;
+		if (!notify_next_deadline || deadline_passed(
+			    self->env_notify_deadline, notify_next_deadline))
+			notify_next_deadline = self->env_notify_deadline;
+	}
+	spin_unlock(&notify_lock);
+
+	// Whoever wakes us sets our return value.
+	sched_block();	// not return
+}
+
 // Invoke NIC driver to send packets. If NIC tx descriptor ring is full,
 // the function will spin for a free descriptor. 
 //
@@ -491,12 +1333,17 @@ sys_ipc_recv(void *dstva)
 static int 
 sys_net_send(void *buf, int len)
 {
+	int r;
+	
 	user_mem_assert(curenv, buf, len, PTE_P | PTE_U);
 	
 	if (len > 1518)
 		return -E_INVAL;
 	
-	return e1000_tx((uint8_t *)buf, len);
+	spin_lock(&e1000_lock);
+	r = e1000_tx((uint8_t *)buf, len);
+	spin_unlock(&e1000_lock);
+	return r;
 }
 
 
@@ -511,19 +1358,22 @@ sys_net_recv(void *buf, int bufsize, int *packet_size)
 	user_mem_assert(curenv, packet_size, sizeof(int), PTE_P | PTE_U | PTE_W);
 	
 	int r;
+	spin_lock(&e1000_lock);
 	if ((r = e1000_rx((uint8_t *)buf, bufsize, packet_size)) == -E_NO_DATA) {
 		// since no data, we suspend current environment by marking it not 
 		// RUNNABLE. when a new packet received, we resume the environment. 
 		// now we need to make a flag to indicate the environment is suspended.
 		// And we need to save the arguments of the syscall userd by resume.
-		curenv->env_status = ENV_NOT_RUNNABLE;
+		env_lock(curenv);
 		curenv->env_net_recving = 1;
 		curenv->env_net_buf = buf;
 		curenv->env_net_buf_size = bufsize;
 		curenv->env_net_packet_size_store = packet_size;
 		suspend_env = curenv;
-		sched_yield();
+		spin_unlock(&e1000_lock);
+		sched_block();
 	} 
+	spin_unlock(&e1000_lock);
 	return r > 0 ? 0 : r;
 }
 
@@ -534,6 +1384,67 @@ sys_net_read_mac_addr(void *buf)
 	return e1000_read_mac_addr((uint8_t *)buf);
 }
 
+// Pin envid to CPU 'cpu' (an index into the kernel's cpus[] array),
+// so the scheduler only ever runs it there, or let it run anywhere
+// again if 'cpu' is -1.  Unpinned envs still prefer the CPU they
+// last ran on.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if cpu is neither -1 nor a CPU in the system.
+static int
+sys_env_set_affinity(envid_t envid, int cpu)
+{
+	struct Env *env;
+
+	if (cpu < -1 || cpu >= ncpu)
+		return -E_INVAL;
+	if (envid2env_lock(envid, &env, 1) < 0)
+		return -E_BAD_ENV;
+	sched_set_affinity(env, cpu);
+	env_unlock(env);
+	return 0;
+}
+
+// Set the static priority of envid to 'prio', between ENV_PRIO_HIGH
+// and ENV_PRIO_LOW.  The env runs at this level again right away,
+// and returns to it whenever it blocks or is boosted, however far it
+// has been demoted for using up its time slices.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if prio is not a valid priority level.
+static int
+sys_env_set_priority(envid_t envid, int prio)
+{
+	struct Env *env;
+
+	if (prio < ENV_PRIO_HIGH || prio > ENV_PRIO_LOW)
+		return -E_INVAL;
+	if (envid2env_lock(envid, &env, 1) < 0)
+		return -E_BAD_ENV;
+	sched_set_priority(env, prio);
+	env_unlock(env);
+	return 0;
+}
+
+// Copy CPU 'cpu's scheduler statistics to 'stats'.  Per-environment
+// accounting needs no system call: it is in the envs[] array.
+//
+// Returns the number of CPUs on success, < 0 on error.  Errors are:
+//	-E_INVAL if cpu is not a CPU in the system.
+static int
+sys_sched_stats(int cpu, struct SchedStats *stats)
+{
+	if (cpu < 0 || cpu >= ncpu)
+		return -E_INVAL;
+	user_mem_assert(curenv, stats, sizeof(*stats), PTE_U | PTE_W);
+	*stats = cpus[cpu].cpu_stats;
+	return ncpu;
+}
+
 // Return the current time.
 static int
 sys_time_msec(void)
@@ -542,6 +1453,88 @@ sys_time_msec(void)
 	return time_msec();
 }
 
+// Store the time since boot, in microseconds, at 'usec'.
+static int
+sys_time_usec(uint64_t *usec)
+{
+	user_mem_assert(curenv, usec, sizeof(*usec), PTE_U | PTE_W);
+	*usec = time_usec();
+	return 0;
+}
+
+// Store the time since boot, in nanoseconds, at 'ns'.
+static int
+sys_time_ns(uint64_t *ns)
+{
+	user_mem_assert(curenv, ns, sizeof(*ns), PTE_U | PTE_W);
+	*ns = time_ns();
+	return 0;
+}
+
+// Run the 'n' system calls described by 'descs', in order, storing
+// each one's result in its sd_ret, and stop at the first that fails.
+// Only calls that return to the caller may be batched: SYS_page_alloc,
+// SYS_page_map, SYS_page_unmap, SYS_env_set_status,
+// SYS_env_set_pgfault_upcall, SYS_env_set_affinity and
+// SYS_env_set_priority.
+//
+// Returns the number of calls that succeeded (n if they all did),
+// < 0 on error.  Errors are:
+//	-E_INVAL if n > SYSBATCH_MAX.
+//	-E_FAULT if a call unmapped the descriptors before they were
+//		all run.
+// A call that fails or can't be batched is not an error of
+// sys_batch; its sd_ret says why.
+static int
+sys_batch(struct SyscallDesc *descs, uint32_t n)
+{
+	struct SyscallDesc d;
+	uint32_t i;
+	int r = 0;
+
+	if (n > SYSBATCH_MAX)
+		return -E_INVAL;
+	user_mem_assert(curenv, descs, n * sizeof(*descs), PTE_U | PTE_W);
+
+	// The batch's unmaps shoot down other CPUs' TLBs in one round.
+	tlb_batch_begin();
+	for (i = 0; i < n; i++) {
+		// An earlier call may have changed the mapping of descs.
+		if (user_mem_check(curenv, &descs[i], sizeof(d),
+				   PTE_U | PTE_W) < 0) {
+			r = -E_FAULT;
+			break;
+		}
+		d = descs[i];
+		switch (d.sd_num) {
+		case SYS_page_alloc:
+		case SYS_page_map:
+		case SYS_page_unmap:
+		case SYS_env_set_status:
+		case SYS_env_set_pgfault_upcall:
+		case SYS_env_set_affinity:
+		case SYS_env_set_priority:
+			d.sd_ret = syscall(d.sd_num, d.sd_args[0], d.sd_args[1],
+					   d.sd_args[2], d.sd_args[3],
+					   d.sd_args[4]);
+			break;
+		default:
+			d.sd_ret = -E_INVAL;
+			break;
+		}
+		if (user_mem_check(curenv, &descs[i], sizeof(d),
+				   PTE_U | PTE_W) < 0) {
+			r = -E_FAULT;
+			break;
+		}
+		descs[i].sd_ret = d.sd_ret;
+		if (d.sd_ret < 0)
+			break;
+	}
+	tlb_batch_end();
+	return r < 0 ? r : (int) i;
+}
+
 // Dispatches to the correct kernel function, passing the arguments.
 int32_t
 syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5)
@@ -564,11 +1557,44 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 			ret = (int32_t)sys_env_destroy((envid_t)a1);
 			break;
 		case SYS_yield:
-			sched_yield(); //not return
+			sys_yield(); //not return
 			break; 
 		case SYS_exofork:
 			ret = sys_exofork();
 			break;
+		case SYS_fork:
+			ret = sys_fork();
+			break;
+		case SYS_superpage_alloc:
+			ret = sys_superpage_alloc((envid_t)a1, (void *)a2, (int)a3);
+			break;
+		case SYS_ipc_send:
+			ret = sys_ipc_send((envid_t)a1, a2, (void *)a3,
+				(unsigned)a4, a5);
+			break;
+		case SYS_ipc_send_recv:
+			ret = sys_ipc_send_recv((envid_t)a1, a2,
+				(const struct IpcPages *)a3, (void *)a4, a5);
+			break;
+		case SYS_ipc_sendv:
+			ret = sys_ipc_sendv((envid_t)a1, a2,
+				(const struct IpcPages *)a3, a4);
+			break;
+		case SYS_ipc_recvv:
+			ret = sys_ipc_recvv((void *)a1, a2);
+			break;
+		case SYS_ipc_send_regs:
+			ret = sys_ipc_send_regs((envid_t)a1, a2, a3, a4, a5);
+			break;
+		case SYS_ipc_call_regs:
+			ret = sys_ipc_call_regs((envid_t)a1, a2, a3, a4, a5);
+			break;
+		case SYS_notify:
+			ret = sys_notify((envid_t)a1, a2);
+			break;
+		case SYS_wait_notify:
+			ret = sys_wait_notify(a1, a2);
+			break;
 		case SYS_env_set_status:
 			ret = sys_env_set_status((envid_t)a1, (int)a2);
 			break;
@@ -597,6 +1623,15 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 		case SYS_time_msec:
 			ret = sys_time_msec();
 			break;
+		case SYS_time_usec:
+			ret = sys_time_usec((uint64_t *)a1);
+			break;
+		case SYS_time_ns:
+			ret = sys_time_ns((uint64_t *)a1);
+			break;
+		case SYS_batch:
+			ret = sys_batch((struct SyscallDesc *)a1, a2);
+			break;
 		case SYS_net_send:
 			ret = sys_net_send((void *)a1, (int)a2);
 			break;
@@ -606,6 +1641,15 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 		case SYS_net_read_mac_addr:
 			ret = sys_net_read_mac_addr((void *)a1);
 			break;
+		case SYS_env_set_affinity:
+			ret = sys_env_set_affinity((envid_t)a1, (int)a2);
+			break;
+		case SYS_env_set_priority:
+			ret = sys_env_set_priority((envid_t)a1, (int)a2);
+			break;
+		case SYS_sched_stats:
+			ret = sys_sched_stats((int)a1, (struct SchedStats *)a2);
+			break;
 		default:
 			cprintf("syscall: syscall(%d) doesn't exist!", ret);
 			ret = -E_INVAL;
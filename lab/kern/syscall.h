@@ -5,7 +5,14 @@
 #endif
 
 #include <inc/syscall.h>
+#include <inc/env.h>
 
 int32_t syscall(uint32_t num, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5);
 
+void	ipc_init(void);
+void	ipc_tick(void);
+bool	ipc_timeouts_pending(void);
+void	ipc_env_free(struct Env *e);
+void	notify_flush(void);
+
 #endif /* !JOS_KERN_SYSCALL_H */
@@ -1,12 +1,68 @@
 #include <kern/time.h>
+#include <kern/cpu.h>
 #include <inc/assert.h>
+#include <inc/memlayout.h>
+#include <inc/string.h>
+#include <inc/stdio.h>
+#include <inc/x86.h>
 
-static unsigned int ticks;
+// The 8253/8254 programmable interval timer.  Channel 2 is gated
+// through the keyboard controller's port B and can be polled, so it
+// serves as the reference clock for calibrating the TSC and the
+// local APIC timer.
+#define PIT_FREQ	1193182		// PIT input clock, in Hz
+#define PIT_CH2		0x42
+#define PIT_MODE	0x43
+#define PIT_PORTB	0x61
+#define	  PORTB_GATE2	0x01		// Enable channel 2 counting
+#define	  PORTB_SPKR	0x02		// Connect channel 2 to the speaker
+#define	  PORTB_OUT2	0x20		// Channel 2 output
+
+// The clock, on a page of its own that mem_init maps at UTIME.
+struct TimePage *timepage;
+
+// Count down one timer period on PIT channel 2 and measure how far the
+// TSC and the local APIC timer get meanwhile.
+static void
+calibrate(uint64_t *tsc_delta, uint32_t *lapic_delta)
+{
+	uint32_t latch = PIT_FREQ / TIMER_HZ;
+	uint64_t tsc_start;
+	uint32_t lapic_start;
+
+	outb(PIT_PORTB, (inb(PIT_PORTB) & ~PORTB_SPKR) | PORTB_GATE2);
+	// Channel 2, lobyte/hibyte access, mode 0 (interrupt on
+	// terminal count): OUT2 goes high when the count reaches zero.
+	outb(PIT_MODE, 0xb0);
+	outb(PIT_CH2, latch & 0xff);
+	outb(PIT_CH2, latch >> 8);
+
+	lapic_start = lapic_timer_count();
+	tsc_start = read_tsc();
+	while (!(inb(PIT_PORTB) & PORTB_OUT2))
+		;
+	*tsc_delta = read_tsc() - tsc_start;
+	*lapic_delta = lapic_start - lapic_timer_count();
+}
 
 void
 time_init(void)
 {
-	ticks = 0;
+	uint64_t tsc_delta;
+	uint32_t lapic_delta;
+
+	memset(timepage, 0, PGSIZE);
+
+	lapic_timer_calibrate();
+	calibrate(&tsc_delta, &lapic_delta);
+	timepage->tp_tsc_hz = tsc_delta * PIT_FREQ / (PIT_FREQ / TIMER_HZ);
+	timepage->tp_tsc_boot = read_tsc();
+	// Every CPU's local APIC timer now interrupts TIMER_HZ times a
+	// second: the BSP's right away, the APs' from lapic_init.
+	lapic_timer_start(lapic_delta);
+
+	cprintf("time: TSC %llu Hz, LAPIC timer %u counts per tick\n",
+		timepage->tp_tsc_hz, lapic_delta);
 }
 
 // This should be called once per timer interrupt.  A timer interrupt
@@ -14,13 +70,28 @@ time_init(void)
 void
 time_tick(void)
 {
-	ticks++;
+	uint32_t ticks = timepage->tp_ticks + 1;
+
 	if (ticks * 10 < ticks)
 		panic("time_tick: time overflowed");
+	timepage->tp_ticks = ticks;
 }
 
 unsigned int
 time_msec(void)
 {
-	return ticks * 10;
+	return timepage_msec(timepage);
+}
+
+// Nanoseconds since time_init, from the calibrated TSC.
+uint64_t
+time_ns(void)
+{
+	return timepage_ns(timepage, read_tsc());
+}
+
+uint64_t
+time_usec(void)
+{
+	return time_ns() / 1000;
 }
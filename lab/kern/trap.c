@@ -2,6 +2,7 @@
 #include <inc/x86.h>
 #include <inc/assert.h>
 #include <inc/string.h>
+#include <inc/error.h>
 
 #include <kern/pmap.h>
 #include <kern/trap.h>
@@ -65,7 +66,7 @@ static const char *trapname(int trapno)
 
 	if (trapno < sizeof(excnames)/sizeof(excnames[0]))
 		return excnames[trapno];
-	if (trapno == T_SYSCALL)
+	if (trapno == T_SYSCALL || trapno == T_SYSENTER)
 		return "System call";
 	if (trapno >= IRQ_OFFSET && trapno < IRQ_OFFSET + 16)
 		return "Hardware Interrupt";
@@ -122,6 +123,8 @@ trap_init(void)
 	SETGATE(idt[IRQ_OFFSET+IRQ_IDE], 0, GD_KT, (uintptr_t)handler46, 0);
 	SETGATE(idt[IRQ_OFFSET+15], 0, GD_KT, (uintptr_t)handler47, 0);
 	SETGATE(idt[IRQ_OFFSET+IRQ_ERROR], 0, GD_KT, (uintptr_t)handler51, 0);
+	SETGATE(idt[IRQ_OFFSET+IRQ_WAKEUP], 0, GD_KT, (uintptr_t)handler52, 0);
+	SETGATE(idt[IRQ_OFFSET+IRQ_TLB], 0, GD_KT, (uintptr_t)handler53, 0);
 	// Per-CPU setup 
 	trap_init_percpu();
 }
@@ -130,6 +133,8 @@ trap_init(void)
 void
 trap_init_percpu(void)
 {
+	uint32_t edx;
+
 	// The example code here sets up the Task State Segment (TSS) and
 	// the TSS descriptor for CPU 0. But it is incorrect if we are
 	// running on other CPUs because each CPU has its own kernel stack.
@@ -169,6 +174,15 @@ trap_init_percpu(void)
 
 	// Load the IDT
 	lidt(&idt_pd);
+
+	// Set up the sysenter fast system call path, entering at
+	// sysenter_handler on this CPU's kernel stack.
+	cpuid(1, NULL, NULL, NULL, &edx);
+	if (edx & CPUID_SEP) {
+		wrmsr(MSR_IA32_SYSENTER_CS, GD_KT);
+		wrmsr(MSR_IA32_SYSENTER_ESP, thiscpu->cpu_ts.ts_esp0);
+		wrmsr(MSR_IA32_SYSENTER_EIP, (uintptr_t) sysenter_handler);
+	}
 }
 
 void
@@ -224,6 +238,16 @@ trap_dispatch(struct Trapframe *tf)
 	// LAB 3: Your code here.
 	switch (tf->tf_trapno) {
 		case T_DEBUG:
+			// sysenter keeps the user's TF, which traps on the
+			// handler's first instruction.  Resume the handler
+			// with TF clear, and give TF back to the env when it
+			// returns (see T_SYSENTER).
+			if ((tf->tf_cs & 3) == 0
+			    && tf->tf_eip == (uintptr_t) sysenter_handler) {
+				tf->tf_eflags &= ~FL_TF;
+				thiscpu->cpu_sysenter_tf = 1;
+				env_pop_tf(tf);
+			}
 			debug_exception_handler(tf);
 			break;
 		case T_PGFLT:
@@ -242,6 +266,20 @@ trap_dispatch(struct Trapframe *tf)
 										  tf->tf_regs.reg_esi);
 			env_run(curenv);
 			break;
+		case T_SYSENTER:
+			if (thiscpu->cpu_sysenter_tf) {
+				tf->tf_eflags |= FL_TF;
+				thiscpu->cpu_sysenter_tf = 0;
+			}
+			// The user stub only uses sysenter when the fifth
+			// argument is 0; %esi holds its return address.
+			tf->tf_regs.reg_eax = syscall(tf->tf_regs.reg_eax,
+						      tf->tf_regs.reg_edx,
+						      tf->tf_regs.reg_ecx,
+						      tf->tf_regs.reg_ebx,
+						      tf->tf_regs.reg_edi, 0);
+			env_run(curenv);
+			break;
 		
 		// Handle clock interrupts. Don't forget to acknowledge the
 		// interrupt using lapic_eoi() before calling the scheduler!
@@ -253,8 +291,14 @@ trap_dispatch(struct Trapframe *tf)
 		// LAB 6: Your code here.
 		case IRQ_OFFSET + IRQ_TIMER:
 			lapic_eoi();
-			time_tick();
-			sched_yield();
+			// Every CPU gets timer interrupts; only one keeps time.
+			if (thiscpu == bootcpu) {
+				time_tick();
+				ipc_tick();
+			}
+			// Keep running curenv until its time slice is up.
+			if (sched_tick())
+				sched_yield();
 			break;
 		case IRQ_OFFSET + IRQ_KBD:
 			kbd_intr();
@@ -264,6 +308,16 @@ trap_dispatch(struct Trapframe *tf)
 			serial_intr();
 			sched_yield();
 			break;
+		case IRQ_OFFSET + IRQ_WAKEUP:
+			// Another CPU queued an env for this one.
+			lapic_eoi();
+			sched_yield();
+			break;
+		case IRQ_OFFSET + IRQ_TLB:
+			// Another CPU changed an address space loaded here.
+			lapic_eoi();
+			tlb_shootdown_poll();
+			break;
 		case IRQ_OFFSET + IRQ_NETWORK:
 			//lapic_eoi(); //TODO: it seems the statement is useless.
 			irq_eoi();
@@ -333,18 +387,13 @@ trap(struct Trapframe *tf)
 	
 	if ((tf->tf_cs & 3) == 3) {
 		// Trapped from user mode.
-		// Acquire the big kernel lock before doing any
-		// serious kernel work.
-		// LAB 4: Your code here.
-		lock_kernel();
+		// There is no big kernel lock: kernel subsystems take
+		// their own locks (see env_lock, sched.c and pmap.c).
 		assert(curenv);
 
 		// Garbage collect if current enviroment is a zombie
-		if (curenv->env_status == ENV_DYING) {
-			env_free(curenv);
-			curenv = NULL;
-			sched_yield();
-		}
+		if (curenv->env_status == ENV_DYING)
+			env_destroy(curenv);
 
 		// Copy trap frame (which is currently on the stack)
 		// into 'curenv->env_tf', so that running the environment
@@ -373,11 +422,63 @@ trap(struct Trapframe *tf)
 		sched_yield();
 }
 
+// Whether sysenter_trap may run a system call on the lean path: it
+// never blocks, yields or switches envs, and never reads or writes
+// curenv->env_tf, which that path leaves stale.
+static bool
+sysenter_lean(uint32_t syscallno)
+{
+	switch (syscallno) {
+	case SYS_cputs:
+	case SYS_getenvid:
+	case SYS_page_alloc:
+	case SYS_page_map:
+	case SYS_page_unmap:
+	case SYS_env_set_pgfault_upcall:
+	case SYS_ipc_try_send:
+	case SYS_time_msec:
+	case SYS_time_usec:
+	case SYS_time_ns:
+	case SYS_notify:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+// Called by sysenter_handler with the Trapframe it built on the kernel
+// stack.  The common system calls that sysenter_lean allows run here
+// straight from tf's registers, and return to sysenter_handler, which
+// sysexits without tf ever being copied into curenv->env_tf.  The rest
+// go through trap(), as int $T_SYSCALL does, and do not return here.
+void
+sysenter_trap(struct Trapframe *tf)
+{
+	extern char *panicstr;
+
+	asm volatile("cld" ::: "cc");
+	if (panicstr)
+		asm volatile("hlt");
+
+	// A zombie env, or one being single-stepped, takes the full path.
+	if (!sysenter_lean(tf->tf_regs.reg_eax) || thiscpu->cpu_sysenter_tf
+	    || curenv->env_status != ENV_RUNNING)
+		trap(tf);
+
+	// As T_SYSENTER in trap_dispatch.
+	tf->tf_regs.reg_eax = syscall(tf->tf_regs.reg_eax,
+				      tf->tf_regs.reg_edx,
+				      tf->tf_regs.reg_ecx,
+				      tf->tf_regs.reg_ebx,
+				      tf->tf_regs.reg_edi, 0);
+}
+
 
 void
 page_fault_handler(struct Trapframe *tf)
 {
 	uint32_t fault_va;
+	int r;
 
 	// Read processor's CR2 register to find the faulting address
 	fault_va = rcr2();
@@ -422,6 +523,21 @@ page_fault_handler(struct Trapframe *tf)
 	//   (the 'tf' variable points at 'curenv->env_tf').
 
 	// LAB 4: Your code here.
+
+	// A write to a copy-on-write page is resolved right here, without
+	// going through the upcall.
+	if ((tf->tf_err & FEC_WR) && (tf->tf_err & FEC_PR) && fault_va < UTOP) {
+		env_lock(curenv);
+		r = page_cow(curenv->env_pgdir, (void *) fault_va);
+		env_unlock(curenv);
+		if (r == 0)
+			return;
+		if (r == -E_NO_MEM) {
+			cprintf("[%08x] out of memory copying va %08x\n",
+				curenv->env_id, fault_va);
+			env_destroy(curenv);
+		}
+	}
 	user_page_fault_handler(tf, fault_va);
 }
 
@@ -59,5 +59,9 @@ void handler45(void);
 void handler46(void);
 void handler47(void);
 void handler51(void);
+void handler52(void);
+void handler53(void);
+void sysenter_handler(void);
+void sysenter_trap(struct Trapframe *tf);
 
 #endif /* JOS_KERN_TRAP_H */
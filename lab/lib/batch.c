@@ -0,0 +1,51 @@
+// Queue system calls and submit them to the kernel with one sys_batch,
+// instead of trapping once for each.
+
+#include <inc/lib.h>
+
+// The queue fills exactly one page.
+struct SyscallDesc batch_descs[SYSBATCH_MAX] __attribute__((aligned(PGSIZE)));
+static uint32_t nbatch;
+
+// Queue system call 'num' with the given arguments.  If the queue is
+// full, submit it first; returns that submission's result (see
+// batch_flush), or 0.
+int
+batch_add(uint32_t num, uint32_t a1, uint32_t a2, uint32_t a3,
+	  uint32_t a4, uint32_t a5)
+{
+	struct SyscallDesc *d;
+	int r;
+
+	if (nbatch == SYSBATCH_MAX && (r = batch_flush()) < 0)
+		return r;
+	d = &batch_descs[nbatch++];
+	d->sd_num = num;
+	d->sd_args[0] = a1;
+	d->sd_args[1] = a2;
+	d->sd_args[2] = a3;
+	d->sd_args[3] = a4;
+	d->sd_args[4] = a5;
+	return 0;
+}
+
+// Run the queued system calls, in order, with one trap.  Stops at the
+// first one that fails and drops the rest.
+// Returns 0 on success, or the first failing call's error code.
+int
+batch_flush(void)
+{
+	uint32_t n = nbatch;
+	int r;
+
+	// Empty the queue before the calls run, so that a child that
+	// fork copies in the middle of them starts with an empty one.
+	nbatch = 0;
+	if (n == 0)
+		return 0;
+	if ((r = sys_batch(batch_descs, n)) < 0)
+		return r;
+	if (r < n)
+		return batch_descs[r].sd_ret;
+	return 0;
+}
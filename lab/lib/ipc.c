@@ -41,27 +41,160 @@ ipc_recv(envid_t *from_env_store, void *pg, int *perm_store)
 }
 
 // Send 'val' (and 'pg' with 'perm', if 'pg' is nonnull) to 'toenv'.
-// This function keeps trying until it succeeds.
-// It should panic() on any error other than -E_IPC_NOT_RECV.
+// This function waits in the kernel, on toenv's queue of senders,
+// until toenv receives the message.
+// It panics on any error.
 //
 // Hint:
-//   Use sys_yield() to be CPU-friendly.
 //   If 'pg' is null, pass sys_ipc_recv a value that it will understand
 //   as meaning "no page".  (Zero is not the right value.)
 void
 ipc_send(envid_t to_env, uint32_t val, void *pg, int perm)
 {
-	static int i = 0;
 	// LAB 4: Your code here.
 	int r;
-	while ((r = sys_ipc_try_send(to_env, val, pg ? pg :  (void *)UTOP, perm))) {
-		if (r != -E_IPC_NOT_RECV)
-			panic("ipc_send: sys_ipc_try_send return error - %e", r);
-		sys_yield();
-		
-    }
-    //cprintf("ipc_send[%08x] %4d: send to %08x, value = %d success\n", thisenv->env_id, i, to_env, val);
-    i++;
+	if ((r = sys_ipc_send(to_env, val, pg ? pg : (void *)UTOP, perm,
+			      IPC_FOREVER)) < 0)
+		panic("ipc_send: sys_ipc_send return error - %e", r);
+}
+
+// Send 'val' and the pages that 'pg' describes to 'to_env', as
+// ipc_send does.  The receiver gets as many of the pages as its
+// receive window holds (see ipc_recvv).
+void
+ipc_sendv(envid_t to_env, uint32_t val, const struct IpcPages *pg)
+{
+	int r;
+	if ((r = sys_ipc_sendv(to_env, val, pg, IPC_FOREVER)) < 0)
+		panic("ipc_sendv: sys_ipc_sendv return error - %e", r);
+}
+
+// Receive as ipc_recv does, but with room for 'npages' pages at 'pg',
+// for a message sent with ipc_sendv.  thisenv->env_ipc_npages says how
+// many pages arrived; the rest of the window is left unmapped.
+int32_t
+ipc_recvv(envid_t *from_env_store, void *pg, unsigned npages,
+	  int *perm_store)
+{
+	int r;
+	if ((r = sys_ipc_recvv(pg ? pg : (void *)UTOP, pg ? npages : 0)) < 0) {
+		cprintf("ipc_recvv: sys_ipc_recvv return error - %e", r);
+		if (from_env_store)
+			*from_env_store = 0;
+		if (perm_store)
+			*perm_store = 0;
+		return r;
+	}
+	if (from_env_store)
+		*from_env_store = thisenv->env_ipc_from;
+	if (perm_store)
+		*perm_store = thisenv->env_ipc_perm;
+
+	return thisenv->env_ipc_value;
+}
+
+// Send 'val' (and 'pg' with 'perm', if 'pg' is nonnull) to 'to_env',
+// as ipc_send does, and wait for the answer, as ipc_recv does with
+// 'from_env_store', 'rcv_pg' and 'perm_store'.  The kernel switches
+// straight to 'to_env' if it is waiting, so a client's request and a
+// server's reply each cost one trap and no trip through the scheduler.
+// Returns the value received.
+int32_t
+ipc_call(envid_t to_env, uint32_t val, void *pg, int perm,
+	 envid_t *from_env_store, void *rcv_pg, int *perm_store)
+{
+	struct IpcPages pgs;
+
+	pgs.ip_npages = (pg != NULL);
+	pgs.ip_perm = perm;
+	pgs.ip_va[0] = pg;
+	return ipc_callv(to_env, val, &pgs, from_env_store, rcv_pg, 1,
+			 perm_store);
+}
+
+// ipc_call with the pages of an ipc_sendv message going out, and a
+// window of 'rcv_npages' pages at 'rcv_pg' for those of the answer.
+int32_t
+ipc_callv(envid_t to_env, uint32_t val, const struct IpcPages *pg,
+	  envid_t *from_env_store, void *rcv_pg, unsigned rcv_npages,
+	  int *perm_store)
+{
+	int r;
+
+	r = sys_ipc_send_recv(to_env, val, pg, rcv_pg ? rcv_pg : (void *)UTOP,
+			      rcv_pg ? rcv_npages : 0);
+	if (r == -E_IPC_NOT_RECV) {
+		// to_env isn't waiting: queue up behind its other senders.
+		ipc_sendv(to_env, val, pg);
+		return ipc_recvv(from_env_store, rcv_pg, rcv_npages,
+				 perm_store);
+	}
+	if (r < 0)
+		panic("ipc_callv: sys_ipc_send_recv return error - %e", r);
+	if (from_env_store)
+		*from_env_store = thisenv->env_ipc_from;
+	if (perm_store)
+		*perm_store = thisenv->env_ipc_perm;
+
+	return thisenv->env_ipc_value;
+}
+
+// Send 'val' and the IPC_NREGS words at 'regs' to 'to_env' and wait
+// for the answer, as ipc_call does, but with no pages either way: a
+// small request costs no page mapping in the server and no unmapping
+// later.  The answer's words are in thisenv->env_ipc_regs.
+// Returns the value received.
+int32_t
+ipc_call_regs(envid_t to_env, uint32_t val, const uint32_t regs[IPC_NREGS],
+	      envid_t *from_env_store)
+{
+	int r;
+
+	r = sys_ipc_call_regs(to_env, val, regs[0], regs[1], regs[2]);
+	if (r == -E_IPC_NOT_RECV) {
+		// to_env isn't waiting: queue up behind its other senders.
+		if ((r = sys_ipc_send_regs(to_env, val, regs[0], regs[1],
+					   regs[2])) < 0)
+			panic("ipc_call_regs: sys_ipc_send_regs return error - %e", r);
+		return ipc_recv(from_env_store, NULL, NULL);
+	}
+	if (r < 0)
+		panic("ipc_call_regs: sys_ipc_call_regs return error - %e", r);
+	if (from_env_store)
+		*from_env_store = thisenv->env_ipc_from;
+
+	return thisenv->env_ipc_value;
+}
+
+// Make sure the pages at IPCDATA that hold the first 'n' bytes there
+// (at most IPCDATA_NPAGES pages) are mapped.
+int
+ipc_data_map(size_t n)
+{
+	uintptr_t va, end = IPCDATA + MIN(n, IPCDATA_NPAGES * PGSIZE);
+	int r;
+
+	for (va = IPCDATA; va < end; va += PGSIZE)
+		if (!(vpd[PDX(va)] & PTE_P) || !(vpt[PGNUM(va)] & PTE_P))
+			if ((r = sys_page_alloc(0, (void *) va,
+						PTE_P | PTE_U | PTE_W)) < 0)
+				return r;
+	return 0;
+}
+
+// Map the pages at IPCDATA that hold the first 'n' bytes there, as
+// ipc_data_map does, and add them to the message pages 'pg'.
+int
+ipc_data_pages(struct IpcPages *pg, size_t n)
+{
+	uintptr_t va, end = IPCDATA + MIN(n, IPCDATA_NPAGES * PGSIZE);
+	int r;
+
+	if ((r = ipc_data_map(n)) < 0)
+		return r;
+	for (va = IPCDATA; va < end; va += PGSIZE)
+		pg->ip_va[pg->ip_npages++] = (void *) va;
+	return 0;
 }
 
 // Find the first environment of the given type.  We'll use this to
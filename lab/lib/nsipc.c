@@ -8,25 +8,51 @@
 #define REQVA		0x0ffff000
 union Nsipc nsipcbuf __attribute__((aligned(PGSIZE)));
 
+static int nsipc_data(unsigned type, size_t ndata);
+
 // Send an IP request to the network server, and wait for a reply.
 // The request body should be in nsipcbuf, and parts of the response
 // may be written back to nsipcbuf.
 // type: request code, passed as the simple integer IPC value.
+// Small requests (see NSREQ_REGS) go as a register message, taking
+// the first words of nsipcbuf without sending the page.
 // Returns 0 if successful, < 0 on failure.
 static int
 nsipc(unsigned type)
+{
+	return nsipc_data(type, 0);
+}
+
+// nsipc, also sending the pages at IPCDATA that hold 'ndata' bytes,
+// which the server reads or writes.
+static int
+nsipc_data(unsigned type, size_t ndata)
 {
 	static envid_t nsenv;
+	struct IpcPages pg;
+	int r;
+
 	if (nsenv == 0)
 		nsenv = ipc_find_env(ENV_TYPE_NS);
 
 	static_assert(sizeof(nsipcbuf) == PGSIZE);
+	static_assert(sizeof(struct Nsreq_shutdown) <= IPC_NREGS * 4);
+	static_assert(sizeof(struct Nsreq_close) <= IPC_NREGS * 4);
+	static_assert(sizeof(struct Nsreq_listen) <= IPC_NREGS * 4);
+	static_assert(sizeof(struct Nsreq_socket) <= IPC_NREGS * 4);
 
 	if (debug)
 		cprintf("[%08x] nsipc %d\n", thisenv->env_id, type);
 
-	ipc_send(nsenv, type, &nsipcbuf, PTE_P|PTE_W|PTE_U);
-	return ipc_recv(NULL, NULL, NULL);
+	if (NSREQ_REGS(type) && !ndata)
+		return ipc_call_regs(nsenv, type, (uint32_t *) &nsipcbuf, NULL);
+
+	pg.ip_npages = 1;
+	pg.ip_perm = PTE_P|PTE_W|PTE_U;
+	pg.ip_va[0] = &nsipcbuf;
+	if (ndata && (r = ipc_data_pages(&pg, ndata)) < 0)
+		return r;
+	return ipc_callv(nsenv, type, &pg, NULL, NULL, 0, NULL);
 }
 
 int
@@ -93,6 +119,17 @@ nsipc_recv(int s, void *mem, int len, unsigned int flags)
 	nsipcbuf.recv.req_len = len;
 	nsipcbuf.recv.req_flags = flags;
 
+	// Big receives come back in the data pages.
+	if (len >= 1600) {
+		len = MIN(len, IPCDATA_NPAGES * PGSIZE);
+		nsipcbuf.recv.req_len = len;
+		if ((r = nsipc_data(NSREQ_RECV, len)) >= 0) {
+			assert(r <= len);
+			memmove(mem, (void *) IPCDATA, r);
+		}
+		return r;
+	}
+
 	if ((r = nsipc(NSREQ_RECV)) >= 0) {
 		assert(r < 1600 && r <= len);
 		memmove(mem, nsipcbuf.recvRet.ret_buf, r);
@@ -105,6 +142,19 @@ int
 nsipc_send(int s, const void *buf, int size, unsigned int flags)
 {
 	nsipcbuf.send.req_s = s;
+	// Big sends go in the data pages; the caller copes with a
+	// short count.
+	if (size >= 1600) {
+		int r;
+
+		size = MIN(size, IPCDATA_NPAGES * PGSIZE);
+		if ((r = ipc_data_map(size)) < 0)
+			return r;
+		memmove((void *) IPCDATA, buf, size);
+		nsipcbuf.send.req_size = size;
+		nsipcbuf.send.req_flags = flags;
+		return nsipc_data(NSREQ_SEND, size);
+	}
 	assert(size < 1600);
 	memmove(&nsipcbuf.send.req_buf, buf, size);
 	nsipcbuf.send.req_size = size;
@@ -5,6 +5,9 @@
 #define UTEMP2			(UTEMP + PGSIZE)
 #define UTEMP3			(UTEMP2 + PGSIZE)
 
+// Pages staged at UTEMP per batch; each needs a map and an unmap entry.
+#define SPAWN_CHUNK	(SYSBATCH_MAX / 2)
+
 // Helper functions for spawn.
 static int init_stack(envid_t child, const char **argv, uintptr_t *init_esp);
 static int map_segment(envid_t child, uintptr_t va, size_t memsz,
@@ -263,8 +266,7 @@ static int
 map_segment(envid_t child, uintptr_t va, size_t memsz,
 	int fd, size_t filesz, off_t fileoffset, int perm)
 {
-	int i, r;
-	void *blk;
+	int i, k, n, r;
 
 	//cprintf("map_segment %x+%x\n", va, memsz);
 
@@ -275,25 +277,35 @@ map_segment(envid_t child, uintptr_t va, size_t memsz,
 		fileoffset -= i;
 	}
 
-	for (i = 0; i < memsz; i += PGSIZE) {
-		if (i >= filesz) {
-			// allocate a blank page
-			if ((r = sys_page_alloc(child, (void*) (va + i), perm)) < 0)
-				return r;
-		} else {
-			// from file
-			if ((r = sys_page_alloc(0, UTEMP, PTE_P|PTE_U|PTE_W)) < 0)
-				return r;
-			if ((r = seek(fd, fileoffset + i)) < 0)
-				return r;
-			if ((r = readn(fd, UTEMP, MIN(PGSIZE, filesz-i))) < 0)
-				return r;
-			if ((r = sys_page_map(0, UTEMP, child, (void*) (va + i), perm)) < 0)
-				panic("spawn: sys_page_map data: %e", r);
-			sys_page_unmap(0, UTEMP);
+	// File-backed pages are read in runs of up to SPAWN_CHUNK pages
+	// staged at UTEMP, so each run costs one batch of allocations,
+	// one readn and one batch of map/unmap pairs.
+	for (i = 0; i < memsz && i < filesz; i += n * PGSIZE) {
+		n = (ROUNDUP(MIN(filesz, memsz), PGSIZE) - i) / PGSIZE;
+		n = MIN(n, SPAWN_CHUNK);
+		for (k = 0; k < n; k++)
+			batch_add(SYS_page_alloc, 0, (uint32_t) UTEMP + k * PGSIZE,
+				  PTE_P|PTE_U|PTE_W, 0, 0);
+		if ((r = batch_flush()) < 0)
+			return r;
+		if ((r = seek(fd, fileoffset + i)) < 0)
+			return r;
+		if ((r = readn(fd, UTEMP, MIN(n * PGSIZE, filesz - i))) < 0)
+			return r;
+		for (k = 0; k < n; k++) {
+			batch_add(SYS_page_map, 0, (uint32_t) UTEMP + k * PGSIZE,
+				  child, va + i + k * PGSIZE, perm);
+			batch_add(SYS_page_unmap, 0, (uint32_t) UTEMP + k * PGSIZE,
+				  0, 0, 0);
 		}
+		if ((r = batch_flush()) < 0)
+			panic("spawn: sys_page_map data: %e", r);
 	}
-	return 0;
+	// allocate the blank pages
+	for (; i < memsz; i += PGSIZE)
+		if ((r = batch_add(SYS_page_alloc, child, va + i, perm, 0, 0)) < 0)
+			return r;
+	return batch_flush();
 }
 
 // Copy the mappings for shared pages into the child address space.
@@ -1,35 +1,67 @@
 // System call stubs.
 
 #include <inc/syscall.h>
+#include <inc/x86.h>
 #include <inc/lib.h>
 
+// Whether the CPU supports sysenter: 1 if so, 0 if not, -1 if we
+// haven't asked CPUID yet.
+static int have_sysenter = -1;
+
 static inline int32_t
 syscall(int num, int check, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5)
 {
 	int32_t ret;
+	uint32_t edx;
+
+	if (have_sysenter < 0) {
+		cpuid(1, NULL, NULL, NULL, &edx);
+		have_sysenter = !!(edx & CPUID_SEP);
+	}
+
+	// Fast system call: pass the system call number in AX and up
+	// to four parameters in DX, CX, BX, DI.  sysenter saves
+	// neither the user's stack nor its return address, so pass
+	// them in BP and SI.  The kernel returns with sysexit, which
+	// clobbers CX and DX.
+	if (have_sysenter && a5 == 0) {
+		asm volatile("pushl %%ebp\n"
+			"movl %%esp,%%ebp\n"
+			"leal 1f,%%esi\n"
+			"sysenter\n"
+			"1:\n"
+			"popl %%ebp\n"
+			: "=a" (ret),
+			  "+d" (a1),
+			  "+c" (a2)
+			: "a" (num),
+			  "b" (a3),
+			  "D" (a4)
+			: "esi", "cc", "memory");
+	} else {
+		// Generic system call: pass system call number in AX,
+		// up to five parameters in DX, CX, BX, DI, SI.
+		// Interrupt kernel with T_SYSCALL.
+		//
+		// The "volatile" tells the assembler not to optimize
+		// this instruction away just because we don't use the
+		// return value.
+		//
+		// The last clause tells the assembler that this can
+		// potentially change the condition codes and arbitrary
+		// memory locations.
 
-	// Generic system call: pass system call number in AX,
-	// up to five parameters in DX, CX, BX, DI, SI.
-	// Interrupt kernel with T_SYSCALL.
-	//
-	// The "volatile" tells the assembler not to optimize
-	// this instruction away just because we don't use the
-	// return value.
-	//
-	// The last clause tells the assembler that this can
-	// potentially change the condition codes and arbitrary
-	// memory locations.
-
-	asm volatile("int %1\n"
-		: "=a" (ret)
-		: "i" (T_SYSCALL),
-		  "a" (num),
-		  "d" (a1),
-		  "c" (a2),
-		  "b" (a3),
-		  "D" (a4),
-		  "S" (a5)
-		: "cc", "memory");
+		asm volatile("int %1\n"
+			: "=a" (ret)
+			: "i" (T_SYSCALL),
+			  "a" (num),
+			  "d" (a1),
+			  "c" (a2),
+			  "b" (a3),
+			  "D" (a4),
+			  "S" (a5)
+			: "cc", "memory");
+	}
 
 	if(check && ret > 0)
 		panic("syscall %d returned %d (> 0)", num, ret);
@@ -140,3 +172,113 @@ sys_net_read_mac_addr(void *buf)
 {
 	return syscall(SYS_net_read_mac_addr, 1, (uint32_t)buf, 0, 0, 0, 0);
 }
+
+int
+sys_env_set_affinity(envid_t envid, int cpu)
+{
+	return syscall(SYS_env_set_affinity, 1, envid, cpu, 0, 0, 0);
+}
+
+int
+sys_env_set_priority(envid_t envid, int prio)
+{
+	return syscall(SYS_env_set_priority, 1, envid, prio, 0, 0, 0);
+}
+
+int
+sys_sched_stats(int cpu, struct SchedStats *stats)
+{
+	return syscall(SYS_sched_stats, 0, cpu, (uint32_t)stats, 0, 0, 0);
+}
+
+uint64_t
+sys_time_usec(void)
+{
+	uint64_t usec;
+
+	syscall(SYS_time_usec, 0, (uint32_t)&usec, 0, 0, 0, 0);
+	return usec;
+}
+
+uint64_t
+sys_time_ns(void)
+{
+	uint64_t ns;
+
+	syscall(SYS_time_ns, 0, (uint32_t)&ns, 0, 0, 0, 0);
+	return ns;
+}
+
+int
+sys_batch(struct SyscallDesc *descs, uint32_t n)
+{
+	return syscall(SYS_batch, 0, (uint32_t)descs, n, 0, 0, 0);
+}
+
+envid_t
+sys_fork(void)
+{
+	return syscall(SYS_fork, 0, 0, 0, 0, 0, 0);
+}
+
+int
+sys_superpage_alloc(envid_t envid, void *va, int perm)
+{
+	return syscall(SYS_superpage_alloc, 1, envid, (uint32_t) va, perm, 0, 0);
+}
+
+int
+sys_ipc_send_recv(envid_t envid, uint32_t value, const struct IpcPages *pg,
+		  void *dstva, unsigned dstpages)
+{
+	return syscall(SYS_ipc_send_recv, 0, envid, value, (uint32_t) pg,
+		       (uint32_t) dstva, dstpages);
+}
+
+int
+sys_ipc_send(envid_t envid, uint32_t value, void *srcva, int perm,
+	     unsigned timeout)
+{
+	return syscall(SYS_ipc_send, 0, envid, value, (uint32_t) srcva,
+		       perm, timeout);
+}
+
+int
+sys_ipc_sendv(envid_t envid, uint32_t value, const struct IpcPages *pg,
+	      unsigned timeout)
+{
+	return syscall(SYS_ipc_sendv, 0, envid, value, (uint32_t) pg,
+		       timeout, 0);
+}
+
+int
+sys_ipc_recvv(void *dstva, unsigned npages)
+{
+	return syscall(SYS_ipc_recvv, 1, (uint32_t) dstva, npages, 0, 0, 0);
+}
+
+int
+sys_ipc_send_regs(envid_t envid, uint32_t value, uint32_t w1, uint32_t w2,
+		  uint32_t w3)
+{
+	return syscall(SYS_ipc_send_regs, 0, envid, value, w1, w2, w3);
+}
+
+int
+sys_ipc_call_regs(envid_t envid, uint32_t value, uint32_t w1, uint32_t w2,
+		  uint32_t w3)
+{
+	return syscall(SYS_ipc_call_regs, 0, envid, value, w1, w2, w3);
+}
+
+int
+sys_notify(envid_t envid, uint32_t bits)
+{
+	return syscall(SYS_notify, 0, envid, bits, 0, 0, 0);
+}
+
+uint32_t
+sys_wait_notify(uint32_t mask, unsigned timeout)
+{
+	return syscall(SYS_wait_notify, 0, mask, timeout, 0, 0, 0);
+}
@@ -1,6 +1,8 @@
 #include <inc/lib.h>
 
 // Waits until 'envid' exits.
+// Its parent sleeps until the kernel posts NOTIFY_CHILD; anyone else
+// has to poll.
 void
 wait(envid_t envid)
 {
@@ -8,6 +10,10 @@ wait(envid_t envid)
 
 	assert(envid != 0);
 	e = &envs[ENVX(envid)];
-	while (e->env_id == envid && e->env_status != ENV_FREE)
-		sys_yield();
+	while (e->env_id == envid && e->env_status != ENV_FREE) {
+		if (e->env_parent_id == thisenv->env_id)
+			sys_wait_notify(NOTIFY_CHILD, IPC_FOREVER);
+		else
+			sys_yield();
+	}
 }
@@ -8,8 +8,13 @@
 #define TIMER_INTERVAL 250
 
 // Virtual address at which to receive page mappings containing client requests.
+// Each of the QUEUE_SIZE requests in progress has a window of
+// NSREQ_NPAGES pages: the request page, then the data pages of a big
+// send or receive (see nsipc in lib/nsipc.c).  The windows sit below
+// IPCDATA, out of malloc's way.
 #define QUEUE_SIZE	20
-#define REQVA		(0x0ffff000 - QUEUE_SIZE * PGSIZE)
+#define NSREQ_NPAGES	(1 + IPCDATA_NPAGES)
+#define REQVA		(IPCDATA - QUEUE_SIZE * NSREQ_NPAGES * PGSIZE)
 
 /* timer.c */
 void timer(envid_t ns_envid, uint32_t initial_to);
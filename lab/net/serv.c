@@ -64,7 +64,7 @@ get_buffer(void) {
 		return 0;
 	}
 
-	va = (void *)(REQVA + i * PGSIZE);
+	va = (void *)(REQVA + i * NSREQ_NPAGES * PGSIZE);
 	buse[i] = 1;
 
 	return va;
@@ -72,7 +72,7 @@ get_buffer(void) {
 
 static void
 put_buffer(void *va) {
-	int i = ((uint32_t)va - REQVA) / PGSIZE;
+	int i = ((uint32_t)va - REQVA) / (NSREQ_NPAGES * PGSIZE);
 	buse[i] = 0;
 }
 
@@ -101,7 +101,7 @@ net_timer(uint32_t arg)
 	struct timer_thread *t = (struct timer_thread *) arg;
 
 	for (;;) {
-		uint32_t cur = sys_time_msec();
+		uint32_t cur = time_msec();
 
 		lwip_core_lock();
 		t->func();
@@ -169,9 +169,9 @@ process_timer(envid_t envid) {
 		return;
 	}
 
-	start = sys_time_msec();
+	start = time_msec();
 	thread_yield();
-	now = sys_time_msec();
+	now = time_msec();
 
 	to = TIMER_INTERVAL - (now - start);
 	ipc_send(envid, to, 0, 0);
@@ -181,6 +181,11 @@ struct st_args {
 	int32_t reqno;
 	uint32_t whom;
 	union Nsipc *req;
+	void *buf;		// Request buffer req is in, or NULL
+	char *data;		// Data pages sent after req
+	size_t datalen;		// ... and their size, or 0 if none
+	uint32_t regs[IPC_NREGS]; // A register request's Nsipc (see
+				  // NSREQ_REGS), which req points to
 };
 
 static void
@@ -218,12 +223,22 @@ serve_thread(uint32_t a) {
 	case NSREQ_RECV:
 		// Note that we read the request fields before we
 		// overwrite it with the response data.
-		r = lwip_recv(req->recv.req_s, req->recvRet.ret_buf,
-			      req->recv.req_len, req->recv.req_flags);
+		if (args->datalen)
+			r = lwip_recv(req->recv.req_s, args->data,
+				      MIN(req->recv.req_len, args->datalen),
+				      req->recv.req_flags);
+		else
+			r = lwip_recv(req->recv.req_s, req->recvRet.ret_buf,
+				      req->recv.req_len, req->recv.req_flags);
 		break;
 	case NSREQ_SEND:
-		r = lwip_send(req->send.req_s, &req->send.req_buf,
-			      req->send.req_size, req->send.req_flags);
+		if (args->datalen)
+			r = lwip_send(req->send.req_s, args->data,
+				      MIN(req->send.req_size, args->datalen),
+				      req->send.req_flags);
+		else
+			r = lwip_send(req->send.req_s, &req->send.req_buf,
+				      req->send.req_size, req->send.req_flags);
 		break;
 	case NSREQ_SOCKET:
 		r = lwip_socket(req->socket.req_domain, req->socket.req_type,
@@ -252,8 +267,12 @@ serve_thread(uint32_t a) {
 	if (args->reqno != NSREQ_INPUT)
 		ipc_send(args->whom, r, 0, 0);
 
-	put_buffer(args->req);
-	sys_page_unmap(0, (void*) args->req);
+	// The data pages stay mapped until the next request that uses
+	// this buffer replaces them.
+	if (args->buf) {
+		put_buffer(args->buf);
+		sys_page_unmap(0, args->buf);
+	}
 	free(args);
 }
 
@@ -273,7 +292,8 @@ serve(void) {
 
 		perm = 0;
 		va = get_buffer();
-		reqno = ipc_recv((int32_t *) &whom, (void *) va, &perm);
+		reqno = ipc_recvv((int32_t *) &whom, (void *) va, NSREQ_NPAGES,
+				  &perm);
 		if (debug) {
 			cprintf("ns req %d from %08x\n", reqno, whom);
 		}
@@ -285,8 +305,9 @@ serve(void) {
 			continue;
 		}
 
-		// All remaining requests must contain an argument page
-		if (!(perm & PTE_P)) {
+		// All remaining requests but register requests must contain
+		// an argument page
+		if (!(perm & PTE_P) && !NSREQ_REGS(reqno)) {
 			cprintf("Invalid request from %08x: no argument page\n", whom);
 			continue; // just leave it hanging...
 		}
@@ -299,7 +320,21 @@ serve(void) {
 
 		args->reqno = reqno;
 		args->whom = whom;
-		args->req = va;
+		if (perm & PTE_P) {
+			args->req = args->buf = va;
+			args->data = (char *) va + PGSIZE;
+			args->datalen = (thisenv->env_ipc_npages - 1) * PGSIZE;
+		} else {
+			// The request's words are all its arguments, so
+			// it doesn't need the buffer.
+			put_buffer(va);
+			memmove(args->regs, (void *) thisenv->env_ipc_regs,
+				sizeof(args->regs));
+			args->req = (union Nsipc *) args->regs;
+			args->buf = NULL;
+			args->data = NULL;
+			args->datalen = 0;
+		}
 
 		thread_create(0, "serve_thread", serve_thread, (uint32_t)args);
 		thread_yield(); // let the thread created run
@@ -0,0 +1,54 @@
+// Time IPC round trips between two envs that each touch a working set
+// of pages between messages, so every env switch pays for whatever
+// TLB entries it loses.
+// Only need to start one of these -- splits into two with fork.
+
+#include <inc/lib.h>
+
+#define ROUNDS		1000
+#define NTOUCH		32	// Pages each side touches per message
+
+static uint8_t buf[NTOUCH * PGSIZE] __attribute__((aligned(PGSIZE)));
+
+static void
+touch(void)
+{
+	int i;
+
+	for (i = 0; i < NTOUCH; i++)
+		buf[i * PGSIZE]++;
+}
+
+void
+umain(int argc, char **argv)
+{
+	envid_t who;
+	uint64_t start;
+	uint32_t ns;
+	int i;
+
+	if ((who = fork()) == 0) {
+		// One more message than ROUNDS: the first one warms up.
+		for (i = 0; i <= ROUNDS; i++) {
+			ipc_recv(&who, 0, 0);
+			touch();
+			ipc_send(who, i, 0, 0);
+		}
+		return;
+	}
+
+	// The first round trip pays for the copy-on-write faults on buf.
+	touch();
+	ipc_send(who, 0, 0, 0);
+	ipc_recv(0, 0, 0);
+
+	start = time_ns();
+	for (i = 0; i < ROUNDS; i++) {
+		touch();
+		ipc_send(who, i, 0, 0);
+		ipc_recv(0, 0, 0);
+	}
+	ns = (uint32_t) (time_ns() - start);
+	cprintf("pingpongbench: %d round trips touching %d pages: %u ns each\n",
+		ROUNDS, NTOUCH, ns / ROUNDS);
+}
@@ -0,0 +1,48 @@
+// Round-trip register IPC messages through a child that echoes them,
+// including zero words: a zero last word must arrive as zero, not as
+// whatever the system call path left in its register.
+
+#include <inc/lib.h>
+
+static const uint32_t tests[][IPC_NREGS] = {
+	{ 1, 2, 3 },
+	{ 1, 2, 0 },
+	{ 0xdeadbeef, 0, 0 },
+	{ 0, 0, 0 },
+};
+
+#define NTESTS (sizeof(tests) / sizeof(tests[0]))
+
+void
+umain(int argc, char **argv)
+{
+	uint32_t regs[IPC_NREGS];
+	envid_t who;
+	int i, j;
+
+	if ((who = fork()) < 0)
+		panic("fork: %e", who);
+	if (who == 0) {
+		// Echo each message back until told to stop.
+		while (1) {
+			uint32_t val = ipc_recv(&who, 0, 0);
+			if (val == NTESTS)
+				return;
+			memmove(regs, (void *) thisenv->env_ipc_regs,
+				sizeof(regs));
+			sys_ipc_send_regs(who, val, regs[0], regs[1], regs[2]);
+		}
+	}
+
+	for (i = 0; i < NTESTS; i++) {
+		if (ipc_call_regs(who, i, tests[i], NULL) != i)
+			panic("test %d: wrong value back", i);
+		for (j = 0; j < IPC_NREGS; j++)
+			if (thisenv->env_ipc_regs[j] != tests[i][j])
+				panic("test %d: word %d came back %08x, not %08x",
+				      i, j, thisenv->env_ipc_regs[j],
+				      tests[i][j]);
+	}
+	ipc_send(who, NTESTS, 0, 0);
+	cprintf("register IPC words round-trip\n");
+}
@@ -0,0 +1,45 @@
+// Send real requests to the network server: bind() goes out with the
+// request page and comes back with no receive window (ipc_callv with
+// zero receive pages), while socket() and listen() go in registers.
+
+#include <inc/lib.h>
+#include <lwip/sockets.h>
+#include <lwip/inet.h>
+
+#define PORT 7
+
+void
+umain(int argc, char **argv)
+{
+	struct sockaddr_in addr;
+	int s1, s2, r;
+
+	// Protocol 0 leaves the third request word zero.
+	if ((s1 = socket(PF_INET, SOCK_STREAM, 0)) < 0)
+		panic("socket: %e", s1);
+	if ((s2 = socket(PF_INET, SOCK_STREAM, 0)) < 0)
+		panic("socket: %e", s2);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(PORT);
+
+	if ((r = bind(s1, (struct sockaddr *) &addr, sizeof(addr))) < 0)
+		panic("bind: %e", r);
+	if ((r = listen(s1, 5)) < 0)
+		panic("listen: %e", r);
+	cprintf("bound and listening\n");
+
+	// The server must have read the address off the request page to
+	// see that the port is taken.
+	if ((r = bind(s2, (struct sockaddr *) &addr, sizeof(addr))) >= 0)
+		panic("second bind to port %d succeeded", PORT);
+	cprintf("second bind refused\n");
+
+	if ((r = close(s2)) < 0)
+		panic("close: %e", r);
+	if ((r = close(s1)) < 0)
+		panic("close: %e", r);
+	cprintf("testnsipc done\n");
+}
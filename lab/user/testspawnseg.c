@@ -0,0 +1,40 @@
+// Spawn a copy of this program and have it check its own segments.
+// The text segment (text and rodata) ends partway through a page, and
+// so do the file-backed part of the data segment and its bss.
+
+#include <inc/lib.h>
+
+#define NBYTES	(PGSIZE + PGSIZE / 2 + 5)
+
+const uint8_t rodata[NBYTES] = { [0 ... NBYTES - 1] = 0xa5 };
+uint8_t data[NBYTES] = { [0 ... NBYTES - 1] = 0x5a };
+uint8_t bss[NBYTES];
+
+static void
+check(const char *what, const uint8_t *p, uint8_t c)
+{
+	int i;
+
+	for (i = 0; i < NBYTES; i++)
+		if (p[i] != c)
+			panic("%s[%d] is %02x, not %02x", what, i, p[i], c);
+}
+
+void
+umain(int argc, char **argv)
+{
+	int r;
+
+	if (argc > 1) {
+		check("rodata", rodata, 0xa5);
+		check("data", data, 0x5a);
+		check("bss", bss, 0);
+		cprintf("spawned segments okay\n");
+		exit();
+	}
+
+	if ((r = spawnl("/testspawnseg", "testspawnseg", "child", 0)) < 0)
+		panic("spawn: %e", r);
+	wait(r);
+	cprintf("testspawnseg done\n");
+}